@@ -0,0 +1,58 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// CRC32
+//
+// The usual CRC-32 (IEEE 802.3, as zlib and the PNG and ZIP formats use
+// it): reflected polynomial 0xEDB88320, starting from and finished with
+// all ones. crc32_of("123456789") is 0xCBF43926.
+//
+// Done a nibble at a time, so the table is 64 bytes.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stdint.h>
+
+#define CRC32_CHECK    0xCBF43926
+
+static const uint32_t crc32_nibble[16] =
+  {
+   0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+   0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+   0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+   0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+  };
+
+// Carry on a CRC, start from crc32_start() and finish with crc32_end()
+static inline uint32_t crc32_update(uint32_t crc, const uint8_t *p, int len)
+{
+  for(int i=0; i<len; i++)
+    {
+      crc ^= p[i];
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+      crc = (crc >> 4) ^ crc32_nibble[crc & 0xF];
+    }
+
+  return(crc);
+}
+
+static inline uint32_t crc32_start(void)
+{
+  return(0xFFFFFFFF);
+}
+
+static inline uint32_t crc32_end(uint32_t crc)
+{
+  return(crc ^ 0xFFFFFFFF);
+}
+
+static inline uint32_t crc32_of(const uint8_t *p, int len)
+{
+  return(crc32_end(crc32_update(crc32_start(), p, len)));
+}
+
+#endif
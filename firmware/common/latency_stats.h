@@ -0,0 +1,65 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus latency statistics
+//
+// core1 timestamps each chip select on its SysTick and keeps log2
+// histograms of the cycle counts. The 'G' command dumps them as a
+// LAT_DUMP_HEADER followed by a LAT_STATS, both little endian, which
+// host_tools/latency_hist reads.
+//
+// Bucket b counts values from 2^(b-1) to 2^b - 1 cycles, bucket 0
+// counts zero. SysTick is 24 bits so 25 buckets cover everything.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef LATENCY_STATS_H
+#define LATENCY_STATS_H
+
+#include <stdint.h>
+
+#define LAT_BUCKETS       25
+
+#define LAT_CE_DATA       0     // CE seen low to data driven (reads)
+#define LAT_HEADROOM      1     // data driven to CE seen high (reads)
+#define LAT_CE_LOW        2     // CE seen low to CE seen high (all cycles)
+#define LAT_NUM           3
+
+typedef struct
+{
+  uint32_t hist[LAT_NUM][LAT_BUCKETS];
+  uint32_t max[LAT_NUM];
+  uint32_t poll_max;    // Longest gap between idle samples
+  uint32_t spin_min;    // Fewest passes round the CE wait after a read
+  uint32_t reads;
+  uint32_t writes;
+} LAT_STATS;
+
+#define LAT_DUMP_MAGIC    0x484C5846      // "FXLH"
+#define LAT_DUMP_VERSION  1
+
+// Build options, so dumps from different firmware can be told apart
+#define LAT_BUILD_SCRATCH      0x01
+#define LAT_BUILD_SPECULATIVE  0x02
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t buckets;
+  uint32_t sys_hz;
+  uint32_t build;
+  uint32_t length;      // of the LAT_STATS that follows
+} LAT_DUMP_HEADER;
+
+static inline int lat_bucket(uint32_t cycles)
+{
+  return( (cycles == 0) ? 0 : (32 - __builtin_clz(cycles)) );
+}
+
+// Smallest value that lands in a bucket
+static inline uint32_t lat_bucket_low(int b)
+{
+  return( (b == 0) ? 0 : (1u << (b - 1)) );
+}
+
+#endif
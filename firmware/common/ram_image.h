@@ -0,0 +1,117 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// FX702P RAM image conversion
+//
+// The emulator keeps the uPD444 RAM exactly as the bus presents it, so
+// nothing is converted on a bus cycle. Everything else converts with
+// ram_image_convert() on the way in or out.
+//
+// Images are packed, two nibbles to a byte, 512 bytes per chip. They
+// differ in address order and data polarity:
+//
+//   bus        bus address order (the FX702P drives the address lines
+//              inverted) and bus polarity (data lines inverted). This is
+//              what the emulator serves from.
+//   slot       canonical address order, bus polarity. The flash slot
+//              format, kept so existing slots still load.
+//   canonical  canonical address order, true data. What the FX702P
+//              program sees, used for dumps and host transfers.
+//
+// Canonical nibble A of a chip is bus nibble A ^ 0x3FF, so reordering a
+// chip reverses its bytes and swaps the nibbles of each byte. Inverting
+// the address twice is a no-op, so the same conversion goes either way.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef RAM_IMAGE_H
+#define RAM_IMAGE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define RAM_IMAGE_CHIP_BYTES   512
+#define RAM_IMAGE_CHIP_WORDS   (RAM_IMAGE_CHIP_BYTES/4)
+
+// Conversion flags
+#define IMAGE_REORDER     1     // between bus and canonical address order
+#define IMAGE_INVERT      2     // between bus and true data
+
+// bus <-> slot and bus <-> canonical
+#define IMAGE_SLOT        IMAGE_REORDER
+#define IMAGE_CANONICAL   (IMAGE_REORDER | IMAGE_INVERT)
+
+// The byte holding canonical byte address A in a bus image. The nibbles
+// are swapped.
+#define RAM_IMAGE_BUS_BYTE(A)  ((A) ^ (RAM_IMAGE_CHIP_BYTES-1))
+
+static inline uint32_t ram_image_load32(const uint8_t *p)
+{
+  uint32_t w;
+
+  memcpy(&w, p, 4);
+  return(w);
+}
+
+static inline void ram_image_store32(uint8_t *p, uint32_t w)
+{
+  memcpy(p, &w, 4);
+}
+
+// Reverse the nibbles of a word (when reordering) and invert them
+static inline uint32_t ram_image_word(uint32_t w, int flags)
+{
+  if( flags & IMAGE_REORDER )
+    {
+      w = __builtin_bswap32(w);
+      w = ((w >> 4) & 0x0F0F0F0F) | ((w & 0x0F0F0F0F) << 4);
+    }
+
+  if( flags & IMAGE_INVERT )
+    {
+      w ^= 0xFFFFFFFF;
+    }
+
+  return(w);
+}
+
+// Convert len bytes, a word at a time. len must be a whole number of
+// chips when reordering. dst may be src.
+static inline void ram_image_convert(uint8_t *dst, const uint8_t *src, int len, int flags)
+{
+  if( flags & IMAGE_REORDER )
+    {
+      for(int chip=0; chip<len; chip+=RAM_IMAGE_CHIP_BYTES)
+	{
+	  const uint8_t *s = src+chip;
+	  uint8_t *d = dst+chip;
+
+	  // Swap the words from each end so it works in place
+	  for(int lo=0, hi=RAM_IMAGE_CHIP_BYTES-4; lo<hi; lo+=4, hi-=4)
+	    {
+	      uint32_t wlo = ram_image_load32(s+lo);
+	      uint32_t whi = ram_image_load32(s+hi);
+
+	      ram_image_store32(d+lo, ram_image_word(whi, flags));
+	      ram_image_store32(d+hi, ram_image_word(wlo, flags));
+	    }
+	}
+    }
+  else
+    {
+      int i;
+
+      for(i=0; i+4<=len; i+=4)
+	{
+	  ram_image_store32(dst+i, ram_image_word(ram_image_load32(src+i), flags));
+	}
+
+      for(; i<len; i++)
+	{
+	  dst[i] = (flags & IMAGE_INVERT) ? (src[i] ^ 0xFF) : src[i];
+	}
+    }
+}
+
+#endif
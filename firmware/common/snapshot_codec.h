@@ -0,0 +1,410 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// RAM snapshot codec
+//
+// Images are mostly runs of 0x00 and 0xFF with some repeated program
+// text, so a byte oriented mix of runs, back references and literals
+// does well without any tables to ship. The encoded stream is a series
+// of tokens:
+//
+//   0LLLLLLL                   L+1 literal bytes follow (1 to 128)
+//   10LLLLLL B                 L+3 copies of B (3 to 66)
+//   11LLLLLL OOOOOOOO OOOOOOOO L+4 bytes copied from O+1 bytes back, O
+//                              little endian (4 to 67)
+//
+// Neither side allocates. The encoder's hash of recent positions is in a
+// SNAP_STATE the caller provides. The decoder can write straight into a
+// bus image, converting as it goes with the ram_image.h flags, so a slot
+// or canonical stream loads with no copy in between.
+//
+// Sparse streams are the other way to store an image, see below.
+//
+// The 'x' and 'X' commands move images over the serial port as a
+// SNAP_WIRE_HEADER and a canonical stream, see host_tools/snap_tool.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef SNAPSHOT_CODEC_H
+#define SNAPSHOT_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "ram_image.h"
+
+#define SNAP_LITERAL_MAX  128
+#define SNAP_RUN_MIN      3
+#define SNAP_RUN_MAX      (SNAP_RUN_MIN + 63)
+#define SNAP_MATCH_MIN    4
+#define SNAP_MATCH_MAX    (SNAP_MATCH_MIN + 63)
+#define SNAP_OFFSET_MAX   65536
+
+#define SNAP_HASH_BITS    8
+#define SNAP_HASH_SIZE    (1 << SNAP_HASH_BITS)
+
+typedef struct
+{
+  uint16_t last[SNAP_HASH_SIZE];        // last position of each hash, +1
+} SNAP_STATE;
+
+#define SNAP_WIRE_MAGIC    0x5A535846      // "FXSZ"
+#define SNAP_WIRE_VERSION  2
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;       // of the decoded image, IMAGE_CANONICAL
+  uint32_t raw_length;  // decoded
+  uint32_t length;      // of the stream that follows
+  uint32_t crc;         // of the decoded image, as common/crc32.h
+} SNAP_WIRE_HEADER;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Decoding into a converted image. Byte A of the stream lands at
+// snap_place(A) as snap_byte(), both their own inverse.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int snap_place(int a, int flags)
+{
+  return( (flags & IMAGE_REORDER) ? RAM_IMAGE_BUS_BYTE(a) : a );
+}
+
+static inline uint8_t snap_byte(uint8_t b, int flags)
+{
+  if( flags & IMAGE_REORDER )
+    {
+      b = (b >> 4) | (b << 4);
+    }
+
+  if( flags & IMAGE_INVERT )
+    {
+      b ^= 0xFF;
+    }
+
+  return(b);
+}
+
+// Copy len bytes of a stream starting at byte a into a converted image
+static inline void snap_put(uint8_t *dst, int a, const uint8_t *src, int len, int flags)
+{
+  if( flags == 0 )
+    {
+      memcpy(dst+a, src, len);
+      return;
+    }
+
+  for(int i=0; i<len; i++)
+    {
+      dst[snap_place(a+i, flags)] = snap_byte(src[i], flags);
+    }
+}
+
+static inline void snap_fill(uint8_t *dst, int a, uint8_t b, int len, int flags)
+{
+  for(int i=0; i<len; i++)
+    {
+      dst[snap_place(a+i, flags)] = snap_byte(b, flags);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int snap_hash(const uint8_t *p)
+{
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+  return( (v * 2654435761U) >> (32 - SNAP_HASH_BITS) );
+}
+
+// Emit pending literals, returns the new output position or -1 if full
+static inline int snap_literals(uint8_t *dst, int out, int dst_max, const uint8_t *src, int from, int to)
+{
+  while( from < to )
+    {
+      int n = to - from;
+
+      if( n > SNAP_LITERAL_MAX )
+	{
+	  n = SNAP_LITERAL_MAX;
+	}
+
+      if( out + 1 + n > dst_max )
+	{
+	  return(-1);
+	}
+
+      dst[out++] = n - 1;
+      memcpy(dst+out, src+from, n);
+      out += n;
+      from += n;
+    }
+
+  return(out);
+}
+
+// Encode len bytes, returns the encoded length or -1 if it doesn't fit
+// in dst_max. Greedy: the longest run, else the last position with the
+// same hash, else a literal.
+static inline int snap_encode(uint8_t *dst, int dst_max, const uint8_t *src, int len, SNAP_STATE *s)
+{
+  int out = 0;
+  int lit = 0;
+  int i = 0;
+
+  memset(s->last, 0, sizeof(s->last));
+
+  while( i < len )
+    {
+      int run = 1;
+      int match = 0;
+      int from = 0;
+
+      while( (i + run < len) && (run < SNAP_RUN_MAX) && (src[i+run] == src[i]) )
+	{
+	  run++;
+	}
+
+      if( (run < SNAP_RUN_MIN) && (i + SNAP_MATCH_MIN <= len) )
+	{
+	  int h = snap_hash(src+i);
+
+	  from = s->last[h] - 1;
+	  s->last[h] = i + 1;
+
+	  if( (from >= 0) && (i - from <= SNAP_OFFSET_MAX) )
+	    {
+	      while( (i + match < len) && (match < SNAP_MATCH_MAX) && (src[from+match] == src[i+match]) )
+		{
+		  match++;
+		}
+	    }
+	}
+
+      if( (run < SNAP_RUN_MIN) && (match < SNAP_MATCH_MIN) )
+	{
+	  i++;
+	  continue;
+	}
+
+      if( (out = snap_literals(dst, out, dst_max, src, lit, i)) < 0 )
+	{
+	  return(-1);
+	}
+
+      if( run >= SNAP_RUN_MIN )
+	{
+	  if( out + 2 > dst_max )
+	    {
+	      return(-1);
+	    }
+	  dst[out++] = 0x80 | (run - SNAP_RUN_MIN);
+	  dst[out++] = src[i];
+	  i += run;
+	}
+      else
+	{
+	  int offset = i - from - 1;
+
+	  if( out + 3 > dst_max )
+	    {
+	      return(-1);
+	    }
+	  dst[out++] = 0xC0 | (match - SNAP_MATCH_MIN);
+	  dst[out++] = offset & 0xFF;
+	  dst[out++] = offset >> 8;
+	  i += match;
+	}
+
+      lit = i;
+    }
+
+  return(snap_literals(dst, out, dst_max, src, lit, len));
+}
+
+// Decode into a dst_len byte image converted with flags. Returns the
+// number of bytes decoded, or -1 if the stream is bad or too long.
+static inline int snap_decode(uint8_t *dst, int dst_len, const uint8_t *src, int src_len, int flags)
+{
+  int in = 0;
+  int out = 0;
+
+  while( in < src_len )
+    {
+      uint8_t t = src[in++];
+      int n;
+
+      if( (t & 0x80) == 0 )
+	{
+	  n = t + 1;
+	  if( (in + n > src_len) || (out + n > dst_len) )
+	    {
+	      return(-1);
+	    }
+	  snap_put(dst, out, src+in, n, flags);
+	  in += n;
+	}
+      else if( (t & 0xC0) == 0x80 )
+	{
+	  n = (t & 0x3F) + SNAP_RUN_MIN;
+	  if( (in + 1 > src_len) || (out + n > dst_len) )
+	    {
+	      return(-1);
+	    }
+	  snap_fill(dst, out, src[in++], n, flags);
+	}
+      else
+	{
+	  int from;
+
+	  n = (t & 0x3F) + SNAP_MATCH_MIN;
+	  if( (in + 2 > src_len) || (out + n > dst_len) )
+	    {
+	      return(-1);
+	    }
+	  from = out - 1 - (src[in] | (src[in+1] << 8));
+	  in += 2;
+
+	  if( from < 0 )
+	    {
+	      return(-1);
+	    }
+
+	  // Byte at a time, the copy can overlap what it writes
+	  for(int i=0; i<n; i++)
+	    {
+	      dst[snap_place(out+i, flags)] = dst[snap_place(from+i, flags)];
+	    }
+	}
+
+      out += n;
+    }
+
+  return(out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Sparse images
+//
+// A cleared FX702P RAM is all one value, and a program and its variables
+// touch a few hundred bytes of it. A sparse stream is the background
+// byte, then each extent that differs from it as a little endian offset
+// and length and its bytes. Extents closer together than their header
+// are merged. Building one is a single pass with no searching, and
+// decoding fills the background and drops the extents in.
+//
+// The extents are also the region index of an image, for the 'r'
+// command.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define SNAP_EXTENT_HEADER  4
+
+// Find the next extent at or after *pos, returns 0 if there isn't one
+static inline int snap_extent(const uint8_t *src, int len, uint8_t background, int *pos, int *length)
+{
+  int i = *pos;
+  int end;
+
+  while( (i < len) && (src[i] == background) )
+    {
+      i++;
+    }
+
+  if( i == len )
+    {
+      return(0);
+    }
+
+  *pos = i;
+  end = i + 1;
+
+  for(i=end; (i < len) && (i - end <= SNAP_EXTENT_HEADER); i++)
+    {
+      if( src[i] != background )
+	{
+	  end = i + 1;
+	}
+    }
+
+  *length = end - *pos;
+  return(1);
+}
+
+// Encode len bytes, returns the encoded length or -1 if it doesn't fit
+// in dst_max
+static inline int snap_sparse_encode(uint8_t *dst, int dst_max, const uint8_t *src, int len, uint8_t background)
+{
+  int out = 0;
+  int pos = 0;
+  int n;
+
+  if( dst_max < 1 )
+    {
+      return(-1);
+    }
+  dst[out++] = background;
+
+  while( snap_extent(src, len, background, &pos, &n) )
+    {
+      if( out + SNAP_EXTENT_HEADER + n > dst_max )
+	{
+	  return(-1);
+	}
+
+      dst[out++] = pos & 0xFF;
+      dst[out++] = pos >> 8;
+      dst[out++] = n & 0xFF;
+      dst[out++] = n >> 8;
+      memcpy(dst+out, src+pos, n);
+      out += n;
+      pos += n;
+    }
+
+  return(out);
+}
+
+// Decode into a dst_len byte image converted with flags, returns dst_len
+// or -1 if the stream is bad
+static inline int snap_sparse_decode(uint8_t *dst, int dst_len, const uint8_t *src, int src_len, int flags)
+{
+  int in = 1;
+
+  if( src_len < 1 )
+    {
+      return(-1);
+    }
+  snap_fill(dst, 0, src[0], dst_len, flags);
+
+  while( in < src_len )
+    {
+      int pos;
+      int n;
+
+      if( in + SNAP_EXTENT_HEADER > src_len )
+	{
+	  return(-1);
+	}
+
+      pos = src[in] | (src[in+1] << 8);
+      n = src[in+2] | (src[in+3] << 8);
+      in += SNAP_EXTENT_HEADER;
+
+      if( (in + n > src_len) || (pos + n > dst_len) )
+	{
+	  return(-1);
+	}
+
+      snap_put(dst, pos, src+in, n, flags);
+      in += n;
+    }
+
+  return(dst_len);
+}
+
+#endif
@@ -0,0 +1,241 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus trace codec
+//
+// The CPU mostly walks the RAM a nibble at a time and reads the same
+// nibbles over and over, so a trace_ring.h record is far bigger than it
+// needs to be. Both sides keep the chip and address of the last event,
+// the last address step, and a shadow of every nibble seen on the bus.
+// A read is "predicted" when its data is what the shadow holds. Tokens:
+//
+//   0nnnnnnn                    n+1 predicted reads, each a step on
+//   10wkssss [0000dddd]         address + s (-8 to 7), which becomes the
+//                               step. Write if w. Data byte if k, else
+//                               predicted
+//   110wdddd                    address + step, data d
+//   1110wkcc aaaaaaaa dddd00aa  chip c, address a, data d if k, else
+//                               predicted. The step is kept.
+//   1111xxxx                    reserved
+//
+// Each coded frame starts from chip 0, address 0 and a step of -1. The
+// shadow carries on from frame to frame except at key frames, where it
+// starts out empty, so a decoder can join at any key frame. Only the
+// events a side has seen go into its shadow, so dropped records don't
+// upset the prediction, it just misses more often.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE_CODEC_H
+#define TRACE_CODEC_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include "trace_ring.h"
+
+#define TRACE_CODEC_CHIPS    4
+#define TRACE_CODEC_NIBBLES  (TRACE_CODEC_CHIPS * 1024)
+
+#define TRACE_RUN_MAX        128
+#define TRACE_STEP_MIN       -8
+#define TRACE_STEP_MAX       7
+
+// Most one call of trace_encode() writes, a run then a far token
+#define TRACE_ENCODE_MAX     4
+
+// Shadow entries are the nibble and this, zero for not seen yet
+#define TRACE_SHADOW_KNOWN   0x10
+
+typedef struct
+{
+  uint8_t shadow[TRACE_CODEC_NIBBLES];
+  int chip;
+  int addr;
+  int step;
+  int run;              // encoder only, predicted reads not written yet
+} TRACE_CODEC;
+
+// Start a frame. A key frame forgets the shadow too.
+static inline void trace_codec_start(TRACE_CODEC *c, int key)
+{
+  if( key )
+    {
+      memset(c->shadow, 0, sizeof(c->shadow));
+    }
+
+  c->chip = 0;
+  c->addr = 0;
+  c->step = -1;
+  c->run = 0;
+}
+
+static inline int trace_codec_next(TRACE_CODEC *c, int step)
+{
+  return( (c->addr + step) & 0x3FF );
+}
+
+// The event has happened, for both sides
+static inline void trace_codec_seen(TRACE_CODEC *c, int chip, int addr, int data)
+{
+  c->chip = chip;
+  c->addr = addr;
+  c->shadow[chip * 1024 + addr] = TRACE_SHADOW_KNOWN | data;
+}
+
+// Write out the predicted reads in hand, returns the bytes written
+static inline int trace_encode_flush(TRACE_CODEC *c, uint8_t *dst)
+{
+  if( c->run == 0 )
+    {
+      return(0);
+    }
+
+  dst[0] = c->run - 1;
+  c->run = 0;
+  return(1);
+}
+
+// Encode a record, returns the bytes written, often none
+static inline int trace_encode(TRACE_CODEC *c, uint8_t *dst, uint32_t rec)
+{
+  int chip  = TRACE_CHIP(rec);
+  int addr  = TRACE_ADDR(rec);
+  int data  = TRACE_DATA(rec);
+  int w     = TRACE_IS_WRITE(rec);
+  int known = (c->shadow[chip * 1024 + addr] == (TRACE_SHADOW_KNOWN | data));
+  int step  = ((addr - c->addr + 512) & 0x3FF) - 512;
+  int n;
+
+  if( (chip == c->chip) && (step == c->step) && !w && known )
+    {
+      trace_codec_seen(c, chip, addr, data);
+
+      if( ++c->run == TRACE_RUN_MAX )
+	{
+	  return(trace_encode_flush(c, dst));
+	}
+      return(0);
+    }
+
+  n = trace_encode_flush(c, dst);
+
+  if( (chip == c->chip) && (step == c->step) && !known )
+    {
+      dst[n++] = 0xC0 | (w << 4) | data;
+    }
+  else if( (chip == c->chip) && (step >= TRACE_STEP_MIN) && (step <= TRACE_STEP_MAX) )
+    {
+      dst[n++] = 0x80 | (w << 5) | ((!known) << 4) | (step & 0xF);
+      if( !known )
+	{
+	  dst[n++] = data;
+	}
+      c->step = step;
+    }
+  else
+    {
+      dst[n++] = 0xE0 | (w << 3) | ((!known) << 2) | chip;
+      dst[n++] = addr & 0xFF;
+      dst[n++] = (known ? 0 : (data << 4)) | (addr >> 8);
+    }
+
+  trace_codec_seen(c, chip, addr, data);
+  return(n);
+}
+
+// Decode a frame's tokens into up to max records. Returns how many, or
+// -1 if the tokens are bad, overflow dst or predict a nibble the shadow
+// doesn't have.
+static inline int trace_decode(TRACE_CODEC *c, uint32_t *dst, int max, const uint8_t *src, int len)
+{
+  int in = 0;
+  int out = 0;
+
+  while( in < len )
+    {
+      uint8_t t = src[in++];
+      int chip = c->chip;
+      int addr = -1;
+      int data = -1;
+      int w = 0;
+      int n = 1;
+
+      if( (t & 0x80) == 0 )
+	{
+	  n = t + 1;
+	}
+      else if( (t & 0xC0) == 0x80 )
+	{
+	  w = (t >> 5) & 1;
+	  c->step = ((t & 0xF) ^ 8) - 8;
+
+	  if( t & 0x10 )
+	    {
+	      if( in >= len )
+		{
+		  return(-1);
+		}
+	      data = src[in++] & 0xF;
+	    }
+	}
+      else if( (t & 0xE0) == 0xC0 )
+	{
+	  w = (t >> 4) & 1;
+	  data = t & 0xF;
+	}
+      else if( (t & 0xF0) == 0xE0 )
+	{
+	  if( in + 2 > len )
+	    {
+	      return(-1);
+	    }
+
+	  w = (t >> 3) & 1;
+	  chip = t & 3;
+	  addr = src[in] | ((src[in+1] & 3) << 8);
+	  if( t & 0x04 )
+	    {
+	      data = src[in+1] >> 4;
+	    }
+	  in += 2;
+	}
+      else
+	{
+	  return(-1);
+	}
+
+      if( out + n > max )
+	{
+	  return(-1);
+	}
+
+      for(int i=0; i<n; i++)
+	{
+	  int d = data;
+
+	  // Far tokens give the address, the rest step
+	  if( (t & 0xF0) != 0xE0 )
+	    {
+	      addr = trace_codec_next(c, c->step);
+	    }
+
+	  if( d < 0 )
+	    {
+	      if( !(c->shadow[chip * 1024 + addr] & TRACE_SHADOW_KNOWN) )
+		{
+		  return(-1);
+		}
+	      d = c->shadow[chip * 1024 + addr] & 0xF;
+	    }
+
+	  trace_codec_seen(c, chip, addr, d);
+	  dst[out++] = TRACE_REC(chip, addr, d, w);
+	}
+    }
+
+  return(out);
+}
+
+#endif
@@ -0,0 +1,118 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus trace ring
+//
+// Each traced bus cycle is one 32 bit record:
+//
+//   bits  0-3   nibble, as the bus carried it
+//   bits  4-13  bus address within the chip
+//   bits 14-15  chip
+//   bit  16     write
+//
+// Core1 produces and core0 consumes, through a power of two ring with a
+// free running head and tail. The producer never waits: a put is a
+// store of the record and a release store of head + 1. If the consumer
+// falls behind the oldest records are overwritten, and the consumer
+// counts them as lost. A read checks head again after copying, so
+// anything overwritten while it was being copied is dropped, not
+// returned.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef TRACE_RING_BITS
+#define TRACE_RING_BITS   12
+#endif
+
+#define TRACE_RING_SIZE   (1 << TRACE_RING_BITS)
+#define TRACE_RING_MASK   (TRACE_RING_SIZE - 1)
+
+#define TRACE_WRITE       (1 << 16)
+
+#define TRACE_REC(CHIP, ADDR, DATA, WRITE) \
+  ((DATA) | ((ADDR) << 4) | ((CHIP) << 14) | ((WRITE) ? TRACE_WRITE : 0))
+
+#define TRACE_DATA(R)     ((R) & 0xF)
+#define TRACE_ADDR(R)     (((R) >> 4) & 0x3FF)
+#define TRACE_CHIP(R)     (((R) >> 14) & 0x3)
+#define TRACE_IS_WRITE(R) (((R) & TRACE_WRITE) != 0)
+
+typedef struct
+{
+  uint32_t head;        // written by the producer only
+  uint32_t tail;        // written by the consumer only
+  uint32_t lost;        // overwritten before they were read
+  uint32_t rec[TRACE_RING_SIZE];
+} TRACE_RING;
+
+static inline void trace_ring_put(TRACE_RING *r, uint32_t rec)
+{
+  uint32_t h = r->head;
+
+  r->rec[h & TRACE_RING_MASK] = rec;
+  __atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+// Skip whatever is in the ring, reading starts with the next put
+static inline void trace_ring_flush(TRACE_RING *r)
+{
+  r->tail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  r->lost = 0;
+}
+
+// Copy up to max records out, oldest first. Returns how many, the first
+// being record number r->tail - n.
+static inline int trace_ring_read(TRACE_RING *r, uint32_t *dst, int max)
+{
+  uint32_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  uint32_t tail = r->tail;
+  uint32_t n;
+  uint32_t gone;
+
+  if( head - tail > TRACE_RING_SIZE )
+    {
+      r->lost += head - tail - TRACE_RING_SIZE;
+      tail = head - TRACE_RING_SIZE;
+    }
+
+  n = head - tail;
+  if( n > (uint32_t)max )
+    {
+      n = max;
+    }
+
+  for(uint32_t i=0; i<n; i++)
+    {
+      dst[i] = r->rec[(tail + i) & TRACE_RING_MASK];
+    }
+
+  // The put after head overwrites record head - TRACE_RING_SIZE before
+  // head moves, so anything up to there could have changed under us
+  head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+  gone = head + 1 - TRACE_RING_SIZE - tail;
+
+  if( (int32_t)gone > 0 )
+    {
+      if( gone > n )
+	{
+	  gone = n;
+	}
+
+      memmove(dst, dst + gone, (n - gone) * sizeof(dst[0]));
+      r->lost += gone;
+      tail += gone;
+      n -= gone;
+    }
+
+  r->tail = tail + n;
+  return(n);
+}
+
+#endif
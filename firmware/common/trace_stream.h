@@ -0,0 +1,66 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus trace stream
+//
+// The RAM replacement firmware streams trace_ring.h records to the host
+// on a bulk IN endpoint of its vendor interface, see the 'U' command and
+// host_tools/trace_capture.c.
+//
+// Every transfer is one TRACE_FRAME_BYTES frame: a TRACE_FRAME header
+// then bytes of payload, the rest padding. Frames are always full length
+// so a host read of TRACE_FRAME_BYTES is always exactly one frame. The
+// payload is count records, or the trace_codec.h tokens for them in a
+// coded or key frame.
+//
+// Drops are in band. seq is the record number of the first record, so a
+// gap from the last frame is records lost. lost counts records dropped
+// on the device, overwritten in the ring before core0 could take them or
+// thrown away when the USB was reset. stalls counts the times core0 had
+// records but both buffers were still waiting for the host. Both count
+// from the start of the stream.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TRACE_STREAM_H
+#define TRACE_STREAM_H
+
+#include <stdint.h>
+
+#define TRACE_FRAME_MAGIC    0x46525446      // "FTRF"
+#define TRACE_FRAME_VERSION  2
+
+#define TRACE_FRAME_BYTES    4096
+
+// Vendor interface, after the two CDC ones
+#define TRACE_USB_VID        0x2E8A
+#define TRACE_USB_PID        0x000A
+#define TRACE_USB_INTERFACE  2
+#define TRACE_USB_SUBCLASS   0x70
+#define TRACE_USB_EP         0x83
+
+// Formats
+#define TRACE_FORMAT_RAW     0
+#define TRACE_FORMAT_CODED   1
+#define TRACE_FORMAT_KEY     2          // coded, the shadow starts empty
+
+// Coded frames, a key frame at least this often
+#define TRACE_KEY_FRAMES     16
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t format;
+  uint32_t seq;         // record number of the first
+  uint32_t count;       // records in this frame
+  uint32_t bytes;       // of payload
+  uint32_t lost;        // dropped on the device
+  uint32_t stalls;      // no buffer free when there were records
+} TRACE_FRAME;
+
+#define TRACE_FRAME_PAYLOAD  (TRACE_FRAME_BYTES - sizeof(TRACE_FRAME))
+#define TRACE_FRAME_RECORDS  (TRACE_FRAME_PAYLOAD / sizeof(uint32_t))
+
+#endif
@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// uPD444 bus topology
+//
+// Everything the bus engine knows about the wiring comes from a handful
+// of parameters the firmware defines before including this:
+//
+//   BUS_NUM_CE         number of chips, one active low CE line each (4 or 5)
+//   BUS_ADDR_BITS      address lines per chip
+//   BUS_A0_PIN         first of the address GPIOs
+//   BUS_D0_PIN         first of the four data GPIOs
+//   BUS_CE0_PIN        first of the CE GPIOs
+//   BUS_W_PIN          the active low write GPIO
+//   BUS_ADDR_INVERTED  1 if the CPU drives the address lines inverted
+//
+// Address, data and CE lines must each be on consecutive GPIOs. The
+// masks, sizes and the chip select decode table all follow from these at
+// compile time, so each build gets a loop with its own constants folded
+// in. Data is stored as the bus presents it, so data polarity never
+// reaches the engine.
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef UPD444_BUS_H
+#define UPD444_BUS_H
+
+#if !defined(BUS_NUM_CE) || !defined(BUS_ADDR_BITS) || !defined(BUS_A0_PIN) || !defined(BUS_D0_PIN) || !defined(BUS_CE0_PIN) || !defined(BUS_W_PIN) || !defined(BUS_ADDR_INVERTED)
+#error Define the bus topology before including upd444_bus.h
+#endif
+
+#define A0_PIN          BUS_A0_PIN
+#define D0_PIN          BUS_D0_PIN
+#define CE0_PIN         BUS_CE0_PIN
+#define W_PIN           BUS_W_PIN
+
+#define NUM_CE          BUS_NUM_CE
+#define CE_MASK         ((1 << NUM_CE) - 1)
+
+#define NUM_ADDR        BUS_ADDR_BITS
+#define ADDRESS_MASK    ((1 << NUM_ADDR) - 1)
+
+#define NUM_DATA        4
+#define DATA_MASK       0x0F
+
+// Nibbles per chip and in the whole RAM
+#define RAM_CE_SIZE     (1 << NUM_ADDR)
+#define ROM_SIZE        (NUM_CE*RAM_CE_SIZE)
+
+// All the CE lines high, nothing selected
+#define BUS_CE_IDLE     (CE_MASK << CE0_PIN)
+
+// Bus address to the address the CPU meant, and the bus address of the
+// next ascending CPU address
+#if BUS_ADDR_INVERTED
+#define BUS_CANONICAL_ADDR(A)  (ADDRESS_MASK ^ (A))
+#define BUS_NEXT_ADDR(A)       (((A) - 1) & ADDRESS_MASK)
+#else
+#define BUS_CANONICAL_ADDR(A)  (A)
+#define BUS_NEXT_ADDR(A)       (((A) + 1) & ADDRESS_MASK)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Chip select decode tables
+//
+// Indexed by the raw CE bits. BUS_CE_CHIP() gives the chip a pattern
+// selects, or NUM_CE if it doesn't select exactly one. BUS_CE_BASE() gives
+// the index of that chip's first nibble, or SINK. BUS_CE_TABLE(M) is an
+// initialiser applying M to every pattern.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define BUS_CE_IS(P, C)    (((C) < NUM_CE) && (((P) ^ CE_MASK) == (1 << (C))))
+
+#define BUS_CE_CHIP(P)					\
+  (BUS_CE_IS(P, 0) ? 0 :				\
+   BUS_CE_IS(P, 1) ? 1 :				\
+   BUS_CE_IS(P, 2) ? 2 :				\
+   BUS_CE_IS(P, 3) ? 3 :				\
+   BUS_CE_IS(P, 4) ? 4 : NUM_CE)
+
+#define BUS_CE_BASE(P, SINK)  ((BUS_CE_CHIP(P) == NUM_CE) ? (SINK) : (BUS_CE_CHIP(P) * RAM_CE_SIZE))
+
+#define BUS_CE_4(M, P)     M(P), M((P)+1), M((P)+2), M((P)+3)
+#define BUS_CE_16(M, P)    BUS_CE_4(M, P), BUS_CE_4(M, (P)+4), BUS_CE_4(M, (P)+8), BUS_CE_4(M, (P)+12)
+
+#if NUM_CE == 4
+#define BUS_CE_TABLE(M)    { BUS_CE_16(M, 0) }
+#elif NUM_CE == 5
+#define BUS_CE_TABLE(M)    { BUS_CE_16(M, 0), BUS_CE_16(M, 16) }
+#else
+#error Only 4 and 5 chip topologies are supported
+#endif
+
+#endif
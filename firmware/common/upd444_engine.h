@@ -0,0 +1,676 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// uPD444 bus engine
+//
+// The core1 polling loop, shared by the firmwares. Include it once, from
+// the firmware's .c, after upd444_bus.h and after defining how the RAM is
+// stored:
+//
+//   RAM_NIBBLE(I)         nibble I, I being chip * RAM_CE_SIZE + bus address
+//   SET_RAM_NIBBLE(I, D)  store nibble I
+//
+// A select that isn't exactly one chip is ignored, nothing is driven or
+// stored, unless BUS_INVALID_CE_CHIP says otherwise.
+//
+// Optional, all off if not defined:
+//
+//   BUS_ENGINE_BANK(G)    section attribute for the loop and its tables
+//   BUS_TRACE(S, A, D, F) called with chip, bus address, data and FLAG_READ
+//                         or FLAG_WRITE for each cycle
+//   BUS_WATCH(N, D)       called for each write with the nibble index and
+//                         data, before it's stored
+//   TRACE_ONLY            don't drive reads, trace the data on the bus
+//   SPECULATIVE_READ      drive the next nibble as soon as CE falls, if W
+//                         is high
+//   BUS_LATENCY_STATS     time each cycle with SysTick (latency_stats.h)
+//   BUS_MONITOR           count and log bad selects, short write pulses and
+//                         addresses that change while selected
+//   BUS_DIRTY_SHIFT       keep bus_dirty[], a byte per 1 << BUS_DIRTY_SHIFT
+//                         nibbles, set when the CPU writes any of them
+//   BUS_INVALID_CE_CHIP   serve a select that isn't exactly one chip as
+//                         this chip, as the trace firmware always has
+//   BUS_PAUSE             let core0 stop the loop between cycles with
+//                         bus_pause() and bus_resume(), bus_pause() can
+//                         time out
+//   EM_USB                print each cycle, for debugging only
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef UPD444_ENGINE_H
+#define UPD444_ENGINE_H
+
+#ifndef BUS_ENGINE_BANK
+#define BUS_ENGINE_BANK(G)
+#endif
+
+#ifndef BUS_TRACE
+#define BUS_TRACE(SEL, ADDR, DATA, FLAG)
+#endif
+
+#ifndef BUS_WATCH
+#define BUS_WATCH(N, DATA)
+#endif
+
+#ifndef TRACE_ONLY
+#define TRACE_ONLY         0
+#endif
+
+#ifndef SPECULATIVE_READ
+#define SPECULATIVE_READ   0
+#endif
+
+#ifndef BUS_LATENCY_STATS
+#define BUS_LATENCY_STATS  0
+#endif
+
+#ifndef BUS_MONITOR
+#define BUS_MONITOR        0
+#endif
+
+#ifndef EM_USB
+#define EM_USB             0
+#endif
+
+#ifndef BUS_PAUSE
+#define BUS_PAUSE          0
+#endif
+
+#ifdef BUS_DIRTY_SHIFT
+#define BUS_DIRTY_PAGES    (ROM_SIZE >> BUS_DIRTY_SHIFT)
+#endif
+
+#include "hardware/structs/systick.h"
+#include "upd444_timing.h"
+
+#if BUS_LATENCY_STATS
+#include "latency_stats.h"
+#endif
+
+#define FLAG_WRITE 1
+#define FLAG_READ  2
+
+//-----------------------------------------------------------------------------
+//
+// Put a value on the data out lines. Value is 4 LS bits of the rom array.
+
+static inline void set_data(unsigned int data)
+{
+  int dat = data & DATA_MASK;
+
+  // Direct register access to make things faster
+  sio_hw->gpio_set = (  dat  << D0_PIN);
+  sio_hw->gpio_clr = ((dat ^ DATA_MASK) << D0_PIN);
+}
+
+// Only deals with DOUT pin
+static inline void set_data_inputs(void)
+{
+  sio_hw->gpio_oe_clr = (DATA_MASK << D0_PIN);
+}
+
+static inline void set_data_outputs(void)
+{
+  sio_hw->gpio_oe_set = (DATA_MASK<<D0_PIN);
+}
+
+//-----------------------------------------------------------------------------
+//
+// Timing, see upd444_timing.h. Core1 runs its SysTick free on the
+// processor clock, 24 bits counting down.
+
+#define SYSTICK_MASK 0xFFFFFF
+
+// SysTick cycles to hold read data for after CE is seen high
+uint32_t BUS_ENGINE_BANK("ce_table") bus_hold_cycles = 0;
+
+static inline void hold_data(uint32_t t_ce_high)
+{
+  while( ((t_ce_high - systick_hw->cvr) & SYSTICK_MASK) < bus_hold_cycles )
+    {
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Chip select decode
+//
+// Indexed by the raw CE bits, gives the index of the first nibble of that
+// chip's RAM, so the nibble for bus address A is ce_base[ce] + A and the
+// hot loop needs no switch. Patterns that don't select exactly one chip
+// have ce_chip NUM_CE and the cycle is skipped, or are BUS_INVALID_CE_CHIP
+// if that's defined. Built by the compiler, see upd444_bus.h.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef BUS_INVALID_CE_CHIP
+#define CE_BASE_ENTRY(P)   BUS_CE_BASE(P, BUS_INVALID_CE_CHIP * RAM_CE_SIZE)
+#define CE_CHIP_ENTRY(P)   ((BUS_CE_CHIP(P) == NUM_CE) ? BUS_INVALID_CE_CHIP : BUS_CE_CHIP(P))
+#else
+#define CE_BASE_ENTRY(P)   BUS_CE_BASE(P, 0)
+#define CE_CHIP_ENTRY(P)   BUS_CE_CHIP(P)
+#endif
+
+const unsigned int BUS_ENGINE_BANK("ce_table") ce_base[CE_MASK+1] = BUS_CE_TABLE(CE_BASE_ENTRY);
+const uint8_t BUS_ENGINE_BANK("ce_table") ce_chip[CE_MASK+1] = BUS_CE_TABLE(CE_CHIP_ENTRY);
+
+#if BUS_MONITOR
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus integrity monitor
+//
+// Every select is put in one class and counted. Anything but a valid
+// select is also logged with the GPIO samples at the start and end of the
+// cycle, so a fault can be put down to the FX702P bus or to us. Only core1
+// writes the counts and the log, core0 compares them with what it saw last
+// time, so the idle loop has nothing extra to check.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define BUS_VALID        0
+#define BUS_MULTI_CE     1      // more than one CE low, cycle ignored
+#define BUS_W_GLITCH     2      // W low for less than bus_w_glitch_spins
+#define BUS_ADDR_CHANGE  3      // address moved between sampling and CE high
+#define BUS_NUM_CLASS    4
+
+// Shorter W pulses are counted as glitches
+#ifndef BUS_W_GLITCH_NS
+#define BUS_W_GLITCH_NS  (UPD444_T_WP_NS/2)
+#endif
+
+// Cycles per pass round the wait for W to rise
+#define BUS_W_SPIN_CYCLES  5
+
+#define BUS_LOG_SIZE     16
+
+typedef struct
+{
+  uint32_t cls;
+  uint32_t first;       // GPIOs when the cycle was decoded
+  uint32_t last;        // GPIOs at W high for writes, last CE low sample for reads
+} BUS_EVENT;
+
+volatile uint32_t BUS_ENGINE_BANK("ce_table") bus_count[BUS_NUM_CLASS];
+uint32_t BUS_ENGINE_BANK("ce_table") bus_w_glitch_spins;
+
+volatile BUS_EVENT bus_log[BUS_LOG_SIZE];
+volatile uint32_t bus_log_count = 0;    // events ever logged
+
+static inline void bus_event(int cls, uint32_t first, uint32_t last)
+{
+  bus_count[cls]++;
+
+  if( cls != BUS_VALID )
+    {
+      volatile BUS_EVENT *e = &bus_log[bus_log_count % BUS_LOG_SIZE];
+
+      e->cls = cls;
+      e->first = first;
+      e->last = last;
+      bus_log_count++;
+    }
+}
+
+// End of a cycle, off the critical path
+static inline void bus_classify(uint32_t first, uint32_t last, uint32_t w_spins)
+{
+  if( w_spins < bus_w_glitch_spins )
+    {
+      bus_event(BUS_W_GLITCH, first, last);
+    }
+  else if( ((first ^ last) & (ADDRESS_MASK << A0_PIN)) != 0 )
+    {
+      bus_event(BUS_ADDR_CHANGE, first, last);
+    }
+  else
+    {
+      bus_event(BUS_VALID, first, last);
+    }
+}
+
+#define MON_HOLD()   held = gpio_states
+#define MON_SPIN()   w_spins++
+#else
+#define MON_HOLD()
+#define MON_SPIN()
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Emulate the RAM chips
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef BUS_DIRTY_SHIFT
+// Core1 sets an entry when a page is written, core0 clears it before
+// copying the page out. A byte each rather than bits so neither core has
+// to read-modify-write the other's changes.
+volatile uint8_t BUS_ENGINE_BANK("ce_table") bus_dirty[BUS_DIRTY_PAGES];
+
+#define MARK_DIRTY(N)  bus_dirty[(N) >> BUS_DIRTY_SHIFT] = 1
+#else
+#define MARK_DIRTY(N)
+#endif
+
+#if BUS_PAUSE
+// Core0 asks with a new bus_pause_req, core1 answers by copying it to
+// bus_paused and waits with the bus idle until the request changes. The
+// loop only looks between cycles, so core1 is never part way through
+// storing a nibble while paused. The FX702P isn't served meanwhile, so
+// keep it short.
+//
+// Core1 only gets back to the idle loop once all the CEs are high. With CE
+// held low, or the bus floating with the calculator off, it may never
+// answer, so core0 gives up after BUS_PAUSE_TIMEOUT_US and mustn't touch
+// the RAM. Each request has its own number so a late answer to one that
+// was given up on isn't taken for the next.
+#ifndef BUS_PAUSE_TIMEOUT_US
+#define BUS_PAUSE_TIMEOUT_US  10000
+#endif
+
+volatile uint32_t BUS_ENGINE_BANK("ce_table") bus_pause_req = 0;
+volatile uint32_t BUS_ENGINE_BANK("ce_table") bus_paused = 0;
+volatile uint32_t bus_running = 0;
+uint32_t bus_pause_num = 0;
+
+// Core0, 1 once core1 has stopped, 0 if it didn't in time and the RAM
+// can't be written
+int bus_pause(void)
+{
+  if( !bus_running )
+    {
+      return(1);
+    }
+
+  // Never 0, that's no request
+  if( ++bus_pause_num == 0 )
+    {
+      bus_pause_num = 1;
+    }
+
+  uint32_t start = time_us_32();
+
+  __atomic_store_n(&bus_pause_req, bus_pause_num, __ATOMIC_RELEASE);
+
+  while( __atomic_load_n(&bus_paused, __ATOMIC_ACQUIRE) != bus_pause_num )
+    {
+      if( (time_us_32() - start) > BUS_PAUSE_TIMEOUT_US )
+	{
+	  // Core1 lets go of a request as soon as it changes
+	  __atomic_store_n(&bus_pause_req, 0, __ATOMIC_RELEASE);
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+// Core0, after a bus_pause() that returned 1. Returns once core1 is back
+// serving the bus
+void bus_resume(void)
+{
+  if( bus_running )
+    {
+      __atomic_store_n(&bus_pause_req, 0, __ATOMIC_RELEASE);
+
+      while( __atomic_load_n(&bus_paused, __ATOMIC_ACQUIRE) != 0 )
+	{
+	}
+    }
+}
+#endif
+
+#if SPECULATIVE_READ
+volatile uint32_t BUS_ENGINE_BANK("ce_table") spec_hits   = 0;
+volatile uint32_t BUS_ENGINE_BANK("ce_table") spec_misses = 0;
+#endif
+
+#if BUS_LATENCY_STATS
+// Only core1 writes the stats, core0 asks for a clear with lat_clear. The
+// idle loop looks at them on every pass, so they go with the loop.
+volatile LAT_STATS BUS_ENGINE_BANK("lat") lat;
+volatile int BUS_ENGINE_BANK("lat") lat_clear = 1;
+
+static inline void lat_add(int which, uint32_t cycles)
+{
+  lat.hist[which][lat_bucket(cycles)]++;
+
+  if( cycles > lat.max[which] )
+    {
+      lat.max[which] = cycles;
+    }
+}
+
+void lat_reset(void)
+{
+  volatile uint32_t *p = (volatile uint32_t *)&lat;
+
+  for(int i=0; i<sizeof(LAT_STATS)/sizeof(uint32_t); i++)
+    {
+      p[i] = 0;
+    }
+
+  lat.spin_min = 0xFFFFFFFF;
+}
+
+// Passes round the wait for CE to rise after a read
+#define LAT_SPIN()   spins++
+#else
+#define LAT_SPIN()
+#endif
+
+// Convert the timing for the clock, call before core1 is started
+void bus_engine_init(uint32_t sys_hz)
+{
+  bus_hold_cycles = upd444_hold_cycles(sys_hz);
+
+#if BUS_MONITOR
+  bus_w_glitch_spins = upd444_ns_to_cycles(BUS_W_GLITCH_NS, sys_hz) / BUS_W_SPIN_CYCLES;
+#endif
+}
+
+void BUS_ENGINE_BANK("ram_emulate") ram_emulate(void)
+{
+  //printf("\nEmulating RAM...");
+
+  irq_set_mask_enabled( 0xFFFFFFFF, 0 );
+
+  // Free running on the processor clock, core1 has its own SysTick
+  systick_hw->rvr = SYSTICK_MASK;
+  systick_hw->cvr = 0;
+  systick_hw->csr = 0x5;
+
+#if BUS_LATENCY_STATS
+  uint32_t t_sample;
+  uint32_t t_last = systick_hw->cvr;
+  int was_idle = 0;
+#endif
+
+#if SPECULATIVE_READ
+  // Predicted nibble index and its data
+  unsigned int spec_n = 0;
+  unsigned int spec_data = RAM_NIBBLE(0);
+#endif
+
+#if BUS_PAUSE
+  bus_running = 1;
+#endif
+
+  while(1)
+    {
+      uint32_t gpio_states;
+      unsigned int bus_addr;
+
+#if BUS_LATENCY_STATS
+      t_sample = systick_hw->cvr;
+#endif
+
+      // We look for CE low
+      if( ((gpio_states = sio_hw->gpio_in) & BUS_CE_IDLE) == BUS_CE_IDLE )
+      	{
+	  // S high, we are not selected
+	  // Data lines inputs
+	  set_data_inputs();
+
+#if BUS_LATENCY_STATS
+	  // CE can fall just after a sample, so the gap adds to the latency
+	  uint32_t gap = (t_last - t_sample) & SYSTICK_MASK;
+
+	  if( was_idle && (gap > lat.poll_max) )
+	    {
+	      lat.poll_max = gap;
+	    }
+	  t_last = t_sample;
+	  was_idle = 1;
+
+	  if( lat_clear )
+	    {
+	      lat_reset();
+	      lat_clear = 0;
+	    }
+#endif
+
+#if BUS_PAUSE
+	  uint32_t req = __atomic_load_n(&bus_pause_req, __ATOMIC_ACQUIRE);
+
+	  if( req != 0 )
+	    {
+	      __atomic_store_n(&bus_paused, req, __ATOMIC_RELEASE);
+
+	      while( __atomic_load_n(&bus_pause_req, __ATOMIC_ACQUIRE) == req )
+		{
+		}
+
+#if SPECULATIVE_READ
+	      // Core0 may have changed it
+	      spec_data = RAM_NIBBLE(spec_n);
+#endif
+#if BUS_LATENCY_STATS
+	      // Not a gap in the polling
+	      was_idle = 0;
+#endif
+	      __atomic_store_n(&bus_paused, 0, __ATOMIC_RELEASE);
+	    }
+#endif
+      	}
+      else
+      	{
+	  // CE low, we are selected
+#if BUS_LATENCY_STATS
+	  was_idle = 0;
+#endif
+
+	  // Get the select number and the start of that chip's RAM
+	  int selbits = (gpio_states & BUS_CE_IDLE) >> CE0_PIN;
+	  int selnum = ce_chip[selbits];
+	  unsigned int chip_base = ce_base[selbits];
+
+	  if( selnum == NUM_CE )
+	    {
+	      // Not one of ours, leave the bus and the RAM alone
+#if BUS_MONITOR
+	      bus_event(BUS_MULTI_CE, gpio_states, gpio_states);
+#endif
+	      while( ((gpio_states = sio_hw->gpio_in) & BUS_CE_IDLE) != BUS_CE_IDLE )
+		{
+		}
+	      continue;
+	    }
+
+#if SPECULATIVE_READ && !TRACE_ONLY
+	  // W high when CE fell, guess it's the next read. The data is
+	  // corrected below if the guess was wrong, all within the access
+	  // time.
+	  //
+	  // A write must have W low by the time CE is seen low, or this
+	  // drives against the CPU. The plain read path needs the same, it
+	  // decides on one sample and doesn't look at W again until CE
+	  // rises. If W does fall later, speculation only adds the few
+	  // cycles up to that sample, where the write branch lets go.
+	  if( gpio_states & (1 << W_PIN) )
+	    {
+	      set_data_outputs();
+	      set_data(spec_data);
+	    }
+#endif
+
+#if EM_USB
+	  printf("\nSEL %d", selnum);
+#endif
+	  // We have to monitor W for a write pulse
+	  // if we see it then we write the data on the rising edge of W
+	  // While W is high we treat this as a read and present data
+
+	  while(1)
+	    {
+	      gpio_states = sio_hw->gpio_in;
+
+	      bus_addr = (gpio_states >> A0_PIN) & ADDRESS_MASK;
+	      unsigned int n = chip_base + bus_addr;
+#if BUS_MONITOR
+	      uint32_t first = gpio_states;
+	      uint32_t held;
+	      uint32_t w_spins = 0;
+#endif
+
+	      // Is this a read or a write?
+	      if( (gpio_states & ( 1<< W_PIN))==0 )
+		{
+
+		  // Write
+		  // data lines inputs
+		  set_data_inputs();
+
+		  // Wait for W to go high then latch data
+
+		  while( ((gpio_states = sio_hw->gpio_in) & (1 << W_PIN))==0 )
+		    {
+		      MON_SPIN();
+		    }
+
+		  // We have 4 bits of data to store, they are read from the Dn pins
+		  unsigned int wdata = (gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN;
+
+		  BUS_WATCH(n, wdata);
+		  SET_RAM_NIBBLE(n, wdata);
+		  MARK_DIRTY(n);
+
+#if SPECULATIVE_READ
+		  // Don't serve stale data for the predicted nibble
+		  spec_data = RAM_NIBBLE(spec_n);
+#endif
+
+		  BUS_TRACE(selnum, bus_addr, RAM_NIBBLE(n), FLAG_WRITE);
+
+		  // The address must still be there when W rises
+		  MON_HOLD();
+
+		  while( ((gpio_states = sio_hw->gpio_in) & BUS_CE_IDLE) != BUS_CE_IDLE )
+		    {
+		    }
+
+#if BUS_MONITOR
+		  bus_classify(first, held, w_spins);
+#endif
+
+#if BUS_LATENCY_STATS
+		  lat_add(LAT_CE_LOW, (t_sample - systick_hw->cvr) & SYSTICK_MASK);
+		  lat.writes++;
+#endif
+
+#if EM_USB
+		  printf("\nWR %04X %01X", BUS_CANONICAL_ADDR(bus_addr), (gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN);
+#endif
+		}
+	      else
+		{
+
+		  // Read
+		  // If we are tracing then we sample the read value for tracing
+
+		  // make DOUT an output
+#if !TRACE_ONLY
+		  set_data_outputs();
+
+		  // Get data and present it on bus
+#if SPECULATIVE_READ
+		  if( n == spec_n )
+		    {
+		      // Already on the bus
+		      spec_hits++;
+		    }
+		  else
+		    {
+		      set_data(RAM_NIBBLE(n));
+		      spec_misses++;
+		    }
+#else
+		  set_data(RAM_NIBBLE(n));
+#endif
+#endif
+#if BUS_LATENCY_STATS
+		  uint32_t t_data = systick_hw->cvr;
+		  uint32_t spins = 0;
+#endif
+
+#if TRACE_ONLY
+		  BUS_TRACE(selnum, bus_addr, (gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN, FLAG_READ);
+#else
+		  BUS_TRACE(selnum, bus_addr, RAM_NIBBLE(n), FLAG_READ);
+#endif
+
+#if SPECULATIVE_READ
+		  // Stage the next ascending CPU address while CE is still low
+		  spec_n = chip_base + BUS_NEXT_ADDR(bus_addr);
+		  spec_data = RAM_NIBBLE(spec_n);
+#endif
+
+		  MON_HOLD();
+
+		  while( ((gpio_states = sio_hw->gpio_in) & BUS_CE_IDLE) != BUS_CE_IDLE )
+		    {
+		      LAT_SPIN();
+		      MON_HOLD();
+		    }
+
+		  // Hold the data for tOH then let go of the bus
+		  uint32_t t_rise = systick_hw->cvr;
+
+		  hold_data(t_rise);
+		  set_data_inputs();
+
+#if BUS_MONITOR
+		  // Reads have no W pulse to check
+		  bus_classify(first, held, bus_w_glitch_spins);
+#endif
+
+#if BUS_LATENCY_STATS
+		  // Off the critical path, CE has gone
+		  lat_add(LAT_CE_DATA,  (t_sample - t_data) & SYSTICK_MASK);
+		  lat_add(LAT_HEADROOM, (t_data - t_rise) & SYSTICK_MASK);
+		  lat_add(LAT_CE_LOW,   (t_sample - t_rise) & SYSTICK_MASK);
+
+		  if( spins < lat.spin_min )
+		    {
+		      lat.spin_min = spins;
+		    }
+		  lat.reads++;
+#endif
+
+#if EM_USB
+		  printf("\nRD %04X %01X", BUS_CANONICAL_ADDR(bus_addr), RAM_NIBBLE(n));
+#endif
+		}
+
+	      if( ((gpio_states = sio_hw->gpio_in) & BUS_CE_IDLE) == BUS_CE_IDLE )
+		{
+		  // S gone high, exit the loop. Read data has already been
+		  // held and released.
+		  set_data_inputs();
+#if EM_USB
+		  printf("\nDesel");
+#endif
+		  break;
+		}
+
+	    }
+
+	  // Wait for CE to be de-asserted
+	  while(1)
+	    {
+	      // S high, we are not selected
+	      // data lines inputs
+	      gpio_states = sio_hw->gpio_in;
+
+	      // We look for S
+	      if( (gpio_states & BUS_CE_IDLE) == BUS_CE_IDLE )
+		{
+		  // S high, we are not selected
+		  // data lines inputs
+		  set_data_inputs();
+		  break;
+		}
+	    }
+	}
+    }
+}
+
+#endif
@@ -0,0 +1,119 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// uPD444 bus timing
+//
+// Datasheet limits in nanoseconds and the cycle counts the bus engine
+// works to, converted for the actual clk_sys when core1 is started.
+// host_tools/hold_timing checks the result over a range of clocks.
+//
+// After CE rises a real uPD444 keeps its data on the bus for at least tOH
+// and lets go within tHZ. The engine holds for tOH, counted on SysTick
+// from the moment it sees CE high. How soon it sees CE high depends on
+// the polling loop, so below a certain clk_sys the worst case runs past
+// tHZ, see upd444_release_ok(). The firmware won't build with an OVERCLOCK
+// that fails it for the part being replaced, UPD444_RELEASE_OK_KHZ().
+//
+// Plain C, shared with the host tools.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef UPD444_TIMING_H
+#define UPD444_TIMING_H
+
+#include <stdint.h>
+
+// NEC uPD444 datasheet, datasheets/UPD444-NEC.pdf, AC characteristics
+// (page 77), 444 column
+#define UPD444_T_OH_NS       50     // tOH, output hold from address change, minimum
+#define UPD444_T_HZ_NS      100     // tHZ, chip deselection to output in high Z, maximum
+#define UPD444_T_WP_NS      300     // tWP, write pulse width, minimum
+
+// tHZ of the faster parts, same row, 444-1 to 444-3 columns
+#define UPD444_1_T_HZ_NS     80
+#define UPD444_2_T_HZ_NS     70
+#define UPD444_3_T_HZ_NS     60
+
+// tHZ of speed grade 0 (the plain part) to 3, usable in #if
+#define UPD444_GRADE_T_HZ_NS(G)			\
+  (((G) == 1) ? UPD444_1_T_HZ_NS :		\
+   ((G) == 2) ? UPD444_2_T_HZ_NS :		\
+   ((G) == 3) ? UPD444_3_T_HZ_NS :		\
+   UPD444_T_HZ_NS)
+
+static inline uint32_t upd444_t_hz_ns(int grade)
+{
+  return( UPD444_GRADE_T_HZ_NS(grade) );
+}
+
+// Cycles from CE rising at the pin to the SysTick read after the CE wait.
+// Two for the input synchronisers, then the GPIO read and the SysTick read
+// at best, a whole pass round the wait more at worst. A pass is one more
+// than the bare loop for the bus monitor's copy of the sample.
+#define BUS_CE_SYNC_CYCLES     2
+#define BUS_CE_PASS_CYCLES     6
+#define BUS_CE_SEEN_CYCLES     2
+#define BUS_CE_RISE_MIN_CYCLES (BUS_CE_SYNC_CYCLES + BUS_CE_SEEN_CYCLES)
+#define BUS_CE_RISE_MAX_CYCLES (BUS_CE_RISE_MIN_CYCLES + BUS_CE_PASS_CYCLES)
+
+// One pass round the hold wait, it can overrun by this much
+#define BUS_HOLD_PASS_CYCLES   6
+
+// From the wait ending to the data pins being inputs
+#define BUS_RELEASE_CYCLES     3
+
+// Nanoseconds to cycles, rounded up
+static inline uint32_t upd444_ns_to_cycles(uint32_t ns, uint32_t sys_hz)
+{
+  return( (uint32_t)(((uint64_t)ns * sys_hz + 999999999ULL) / 1000000000ULL) );
+}
+
+static inline double upd444_cycles_to_ns(uint32_t cycles, uint32_t sys_hz)
+{
+  return( cycles * 1.0e9 / sys_hz );
+}
+
+// SysTick cycles to wait after seeing CE high so the data is held for at
+// least tOH
+static inline uint32_t upd444_hold_cycles(uint32_t sys_hz)
+{
+  uint32_t total = upd444_ns_to_cycles(UPD444_T_OH_NS, sys_hz);
+  uint32_t fixed = BUS_CE_RISE_MIN_CYCLES + BUS_RELEASE_CYCLES;
+
+  return( (total > fixed) ? (total - fixed) : 0 );
+}
+
+// Data hold after CE rises, best and worst case, in cycles
+static inline uint32_t upd444_hold_min(uint32_t sys_hz)
+{
+  return( BUS_CE_RISE_MIN_CYCLES + upd444_hold_cycles(sys_hz) + BUS_RELEASE_CYCLES );
+}
+
+static inline uint32_t upd444_hold_max(uint32_t sys_hz)
+{
+  return( BUS_CE_RISE_MAX_CYCLES + upd444_hold_cycles(sys_hz) + BUS_HOLD_PASS_CYCLES + BUS_RELEASE_CYCLES );
+}
+
+// Does the worst case hold end within thz_ns, before the part being
+// replaced would have let go
+static inline int upd444_release_ok(uint32_t sys_hz, uint32_t thz_ns)
+{
+  return( (uint64_t)upd444_hold_max(sys_hz) * 1000000000ULL <= (uint64_t)thz_ns * sys_hz );
+}
+
+// The same check for the preprocessor, clock in kHz. The worst case is
+// tOH plus up to two passes round the polling loops, so the hold can only
+// meet tHZ once those fit in tHZ - tOH: 240MHz for the plain part, 400MHz
+// and up for the faster grades, beyond any OVERCLOCK setting.
+#define UPD444_NS_TO_CYCLES_KHZ(NS, KHZ)  (((NS) * (KHZ) + 999999) / 1000000)
+
+#define UPD444_HOLD_CYCLES_KHZ(KHZ)					\
+  ((UPD444_NS_TO_CYCLES_KHZ(UPD444_T_OH_NS, KHZ) > (BUS_CE_RISE_MIN_CYCLES + BUS_RELEASE_CYCLES)) ? \
+   (UPD444_NS_TO_CYCLES_KHZ(UPD444_T_OH_NS, KHZ) - (BUS_CE_RISE_MIN_CYCLES + BUS_RELEASE_CYCLES)) : 0)
+
+#define UPD444_HOLD_MAX_KHZ(KHZ)					\
+  (BUS_CE_RISE_MAX_CYCLES + UPD444_HOLD_CYCLES_KHZ(KHZ) + BUS_HOLD_PASS_CYCLES + BUS_RELEASE_CYCLES)
+
+#define UPD444_RELEASE_OK_KHZ(KHZ, THZ_NS)		\
+  (UPD444_HOLD_MAX_KHZ(KHZ) * 1000000 <= (THZ_NS) * (KHZ))
+
+#endif
@@ -12,12 +12,27 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "pico/stdlib.h"
 #include "hardware/clocks.h"
 #include "hardware/gpio.h"
 #include "hardware/flash.h"
 #include "pico/multicore.h"
 #include "pico/bootrom.h"
+#include "hardware/pio.h"
+#include "hardware/dma.h"
+#include "hardware/structs/systick.h"
+#include "tusb.h"
+#include "device/usbd_pvt.h"
+
+#include "fx702p_ram_bus.pio.h"
+#include "ram_image.h"
+#include "snapshot_codec.h"
+#include "crc32.h"
+#include "latency_stats.h"
+#include "trace_ring.h"
+#include "trace_stream.h"
+#include "trace_codec.h"
 
 #include "f_util.h"
 
@@ -35,9 +50,72 @@
 #define TEST_ALL_ADDRESS     0
 #define INIT_RAM             1
 #define TRACE_ONLY           0
-#define LOAD_RAM             0
 
-#define BYTE_TO_ROM_DATA(ADDRESS, DATA)       rom_data[(ADDRESS)*2+0] = ((0xFF ^(DATA)) & 0x0f) >> 0; rom_data[(ADDRESS)*2+1] = (((DATA) ^ 0xFF) & 0xf0) >> 4;
+// Set by CMakeLists.txt when FX702P_IMAGE names a RAM image to serve at
+// boot. The build turns it into rom_data[]'s initialiser, see
+// host_tools/image_embed.c
+#ifndef EMBEDDED_IMAGE
+#define EMBEDDED_IMAGE       0
+#endif
+
+#if EMBEDDED_IMAGE
+#include "embedded_image.h"
+#endif
+
+// Serve the bus from PIO and DMA instead of the core1 polling loop
+#define PIO_BUS_ENGINE       0
+
+// Put the core1 loop, its tables and the RAM image in SCRATCH_X so core0
+// traffic in main SRAM can't stall a read. Core1's stack shares the bank,
+// CMakeLists.txt cuts it to 512 bytes to make room.
+#define SCRATCH_BUS_ENGINE   1
+
+// Time each chip select on core1 with its SysTick, for the 'l', 'g' and
+// 'G' commands
+#define BUS_LATENCY_STATS    0
+
+// Speed grade of the uPD444s being replaced, 0 for the plain part or 1 to
+// 3 for -1 to -3. The core1 engine can only let go of the bus within
+// their tHZ at a high enough clk_sys (host_tools/hold_timing), the build
+// stops if OVERCLOCK is too low. Only the plain part can be met.
+#define UPD444_GRADE         0
+
+// Drive the nibble after the last one read as soon as CE falls, before
+// the address is sampled. BASIC mostly reads ascending addresses. Only
+// done with W high as CE falls, see upd444_engine.h.
+#define SPECULATIVE_READ     0
+
+// Count and log bad chip selects, short W pulses and addresses that move
+// while selected, for the 'b' command
+#define BUS_MONITOR          1
+
+// Save back to the last slot loaded or saved this often, if anything has
+// changed. 0 for no autosave.
+#define AUTOSAVE_MS          0
+
+// Work out CRC32s with the DMA sniffer rather than on core0
+#define DMA_CHECKSUM         1
+
+// Slot restored into the RAM at boot, before the bus is served. A slot
+// number, BOOT_LAST_SAVED for the one saved to last or BOOT_NONE to
+// leave the INIT_RAM fill.
+#define BOOT_NONE            -1
+#define BOOT_LAST_SAVED      -2
+#define BOOT_SLOT            BOOT_LAST_SAVED
+
+// Sense the calculator supply on INPUT0 (27) or INPUT1 (26) and save
+// the RAM when it falls, -1 for none. The pin reads high while the
+// supply is good, through a divider or a comparator, and the Pico needs
+// a capacitor to stay up for the time the boot banner reports. Slot
+// POWER_FAIL_SLOT takes the save if none has been loaded.
+#define POWER_FAIL_PIN       -1
+#define POWER_FAIL_SLOT      63
+
+#if SCRATCH_BUS_ENGINE && !PIO_BUS_ENGINE
+#define BUS_ENGINE_BANK(G)   __scratch_x(G)
+#else
+#define BUS_ENGINE_BANK(G)
+#endif
 
 //-----------------------------------------------------------------------------
 //
@@ -53,122 +131,120 @@
 // Do we run emulation on second core?
 #define EMULATE_ON_CORE1   1
 
-// RAM chip is 4K
-// Organised as 4k x 4 bits. We pak into bytes for storage in flash
+// Bus topology, see upd444_bus.h. Four 1K x 4 bit chips, the address
+// lines are driven inverted.
+
+#define BUS_NUM_CE         4
+#define BUS_ADDR_BITS      10
+#define BUS_A0_PIN         0
+#define BUS_D0_PIN         10
+#define BUS_CE0_PIN        14
+#define BUS_W_PIN          19
+#define BUS_ADDR_INVERTED  1
+
+#include "upd444_bus.h"
+
+// RAM is 4K nibbles. We pack into bytes for storage in flash
 
-#define ROM_SIZE  4*1024
 #define ROM_SIZE_BYTES  (ROM_SIZE/2)
 
+// Core1 marks the flash page (512 nibbles) of each write, for saves
+#define BUS_DIRTY_SHIFT 9
+
+#if RAM_CE_SIZE != 2*RAM_IMAGE_CHIP_BYTES
+#error ram_image.h expects 1K nibble chips
+#endif
+
 //--------------------------------------------------------------------------------
 // Flash 
 //
 
-#define FLASH_SLOT_OFFSET (1024*1024)
-uint8_t *flash_slot_contents   = (uint8_t *) (XIP_BASE + FLASH_SLOT_OFFSET);
+// Snapshot store, see store_scan()
+#define FLASH_STORE_OFFSET      (1024*1024)
+#define FLASH_STORE_SIZE        (1000*1024)
+uint8_t *flash_store_contents  = (uint8_t *) (XIP_BASE + FLASH_STORE_OFFSET);
 
-// Flash slots
+// Image pages, each tracked by core1 in bus_dirty[]
+#define IMAGE_PAGES             (ROM_SIZE_BYTES / FLASH_PAGE_SIZE)
 
-#define FLASH_SLOT_SIZE         4096
-#define FLASH_SLOT_AREA_SIZE    (1000*1024)
-#define FLASH_NUM_SLOTS         (FLASH_PROGRAM_SLOT_AREA_SIZE / FLASH_PROGRAM_SLOT_SIZE)
+#if ((ROM_SIZE >> BUS_DIRTY_SHIFT) != IMAGE_PAGES) || (IMAGE_PAGES > 8)
+#error Dirty pages must be flash pages, and fit a record mask
+#endif
 
 #define DISP_WIDTH              16
 
-#define INVERT         1
-#define DO_NOT_INVERT  0
-
-uint8_t packed_ram[ROM_SIZE_BYTES];
+// Bus image converted for flash, dumps and loads
+uint8_t image_buf[ROM_SIZE_BYTES] __attribute__((aligned(4)));
 
-//--------------------------------------------------------------------------------
+// Every byte of a cleared RAM, canonical
+#define RAM_CLEARED             0x00
 
-#define ADDRESS_MASK 0x03FF
+// Compressed image for transfers, room for the worst case of all literals
+uint8_t snap_buf[ROM_SIZE_BYTES + ROM_SIZE_BYTES/SNAP_LITERAL_MAX + 1];
+SNAP_STATE snap_state;
 
-#define RAM_CE_SIZE  1024
+//--------------------------------------------------------------------------------
 
 // Map from memory space to ROM address space
 #define MAP_ROM(X) (X & ADDRESS_MASK)
 
-volatile uint8_t rom_data[ROM_SIZE] =
-  {
-   // ASSEMBLER_EMBEDDED_CODE_START
+// The emulated RAM is held as the bus sees it (see ram_image.h), nibble I
+// being bus address I & ADDRESS_MASK of chip I / RAM_CE_SIZE, so the bus
+// engine never converts anything. RAM_NIBBLE() and SET_RAM_NIBBLE() hide
+// how the nibbles are stored, image_export() and image_import() convert
+// the whole image.
+#if PIO_BUS_ENGINE
+// The PIO engine finds a chip's RAM from the one-hot select pattern, so
+// chip n lives in 1K window (1 << n) of a 16K image, one nibble per byte.
+// See fx702p_ram_bus.pio
+#define ROM_STORAGE_SIZE  (16*RAM_CE_SIZE)
+#define ROM_STORAGE_ALIGN ROM_STORAGE_SIZE
+#define ROM_INDEX(I)      (((1 << ((I) / RAM_CE_SIZE)) * RAM_CE_SIZE) + ((I) % RAM_CE_SIZE))
+
+#define RAM_NIBBLE(I)          (rom_data[ROM_INDEX(I)] & 0xF)
+#define SET_RAM_NIBBLE(I, D)   rom_data[ROM_INDEX(I)] = (D)
+
+#define BYTE_TO_ROM_DATA(ADDRESS, DATA)       SET_RAM_NIBBLE(((ADDRESS)*2+0) ^ ADDRESS_MASK, ((0xFF ^(DATA)) & 0x0f) >> 0); SET_RAM_NIBBLE(((ADDRESS)*2+1) ^ ADDRESS_MASK, (((DATA) ^ 0xFF) & 0xf0) >> 4);
+#else
+// Two nibbles to a byte, even addresses in the low nibble. Storing a
+// nibble reads, merges and writes back the whole byte, so only one core
+// may write rom_data[] at a time: core1 while it's serving the bus, core0
+// only between bus_pause() and bus_resume() (see upd444_engine.h). A byte
+// core0 wrote between core1's read and write back would be lost.
+#define ROM_STORAGE_SIZE  ROM_SIZE_BYTES
+#define ROM_STORAGE_ALIGN 4
 
-   // ASSEMBLER_EMBEDDED_CODE_END
-  };
+#define NIBBLE_SHIFT(I)        (((I) & 1) << 2)
+#define RAM_NIBBLE(I)          ((rom_data[(I) >> 1] >> NIBBLE_SHIFT(I)) & 0xF)
+#define SET_RAM_NIBBLE(I, D)   rom_data[(I) >> 1] = (rom_data[(I) >> 1] & ~(0xF << NIBBLE_SHIFT(I))) | (((D) & 0xF) << NIBBLE_SHIFT(I))
+
+#define SWAP_NIBBLES(B)        ((((B) >> 4) & 0x0F) | (((B) & 0x0F) << 4))
+
+#define BYTE_TO_ROM_DATA(ADDRESS, DATA)       rom_data[RAM_IMAGE_BUS_BYTE(ADDRESS)] = SWAP_NIBBLES(0xFF ^ (DATA));
+#endif
 
-uint8_t rom_data_load[ROM_SIZE/2] =
+volatile uint8_t BUS_ENGINE_BANK("rom_data") rom_data[ROM_STORAGE_SIZE] __attribute__((aligned(ROM_STORAGE_ALIGN))) =
   {
-   0x43, 0x4E, 0x4B, 0x4B, 0x40, 0x51, 0x0F, 0x55, 0x40, 0x51, 0x48, 0x40, 0x41, 0x4B, 0x44, 0x41, 0x4B, 0x44, 0x14, 0xFF, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x16, 0x1C, 0x14, 0x43, 0x4E, 0x4B, 0x4B, 0x40, 0x51, 0x0F, 0x55, 0x40, 0x51, 0x48, 0x40, 0x41, 0x4B, 0x44, 0x14, 0xFF, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x0F, 0x43, 0x4E, 0x4B, 0x4B, 0x40, 0x51, 0x0F, 0x55, 0x40, 0x51, 0x48, 0x40, 0x41, 0x4B, 0x44, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF, 0x10, 0x00, 0x1C, 0x31, 0x32, 0x33, 0xFF, 0x20, 0x00, 0x96, 0x14, 0x47, 0x44, 0x4B, 0x4B, 0x4E, 0x14, 0xFF, 0x30, 0x00, 0x96, 0x59, 0xFF, 0x00, 0x10, 0x96, 0x14, 0x4B, 0x48, 0x4D, 0x44, 0x0F, 0x31, 0x30, 0x30, 0x30, 0x14, 0xFF, 0x00, 0x01, 0x47, 0x1C, 0x34, 0x35, 0xFF, 0x20, 0x01, 0x44, 0x1C, 0x34, 0x37, 0xFF, 0x00, 0x10, 0x96, 0x14, 0x4B, 0x48, 0x4D, 0x44, 0x31, 0x30, 0x30, 0x30, 0x14, 0xFF, 0x99, 0x99, 0x96, 0x14, 0x4B, 0x40, 0x52, 0x53, 0x0F, 0x4B, 0x48, 0x4D, 0x44, 0x14, 0xFF, 0xEA, 0x2A, 0x55, 0x55, 0x57, 0x75, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x05, 0x01, 0x00, 0x00, 0x90, 0x99, 0x99, 0x09, 0x55, 0x40, 0x51, 0x0F, 0x58, 0x16, 0x01, 0x60, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x45, 0x45, 0x45, 0x45, 0x05, 0x00, 0x00, 0x40, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x43, 0x43, 0x43, 0x43, 0x03, 0x00, 0x00, 0x40, 0x42, 0x42, 0x42, 0x42, 0x02, 0x00, 0x00, 0x40, 0x04, 0x01, 0x00, 0x00, 0x00, 0x22, 0x22, 0x02, 0x07, 0x01, 0x00, 0x10, 0x11, 0x11, 0x11, 0x01,
+   // ASSEMBLER_EMBEDDED_CODE_START
+#if EMBEDDED_IMAGE
+#include "embedded_image_data.h"
+#endif
+   // ASSEMBLER_EMBEDDED_CODE_END
   };
 
 //------------------------------------------------------------------------------
 
 
-//
-// The address lines (always inputs)
-//
-const int  A0_PIN  =  0;
-const int  A1_PIN  =  1;
-const int  A2_PIN  =  2;
-const int  A3_PIN  =  3;
-const int  A4_PIN  =  4;
-const int  A5_PIN  =  5;
-const int  A6_PIN  =  6;
-const int  A7_PIN  =  7;
-const int  A8_PIN  =  8;
-const int  A9_PIN  =  9;
-
-const int  D0_PIN = 10;
-const int  D1_PIN = 11;
-const int  D2_PIN = 12;
-const int  D3_PIN = 13;
-
+// The rest of the pin map is in the bus topology above
 const int INPUT1_PIN   = 26;
 const int INPUT0_PIN   = 27;
 
-// 444 has a select pin and an write pin, both active low
-const int CE0_PIN       = 14;
-const int CE1_PIN       = 15;
-const int CE2_PIN       = 16;
-const int CE3_PIN       = 17;
-const int CE4_PIN       = 18;
-
-#define CE_MASK  0x0F
-
-const int W_PIN       = 19;
-
-// Arrays for setting GPIOs up
-#define NUM_ADDR 10
-#define NUM_DATA 4
-
-#define DATA_MASK 0x0F
-
-const int address_pins[NUM_ADDR] =
-  {
-   A0_PIN,
-   A1_PIN,
-   A2_PIN,
-   A3_PIN,
-   A4_PIN,
-   A5_PIN,
-   A6_PIN,
-   A7_PIN,
-   A8_PIN,
-   A9_PIN,
-  };
-
-const int data_pins[NUM_DATA] =
-  {
-   D0_PIN,
-   D1_PIN,
-   D2_PIN,
-   D3_PIN,
-  };
-
 ////////////////////////////////////////////////////////////////////////////////
 
 // Serial loop command structure
 
 typedef void (*FPTR)(void);
+typedef void (*FPTR_OK)(int ok);
 
 typedef struct
 {
@@ -183,7 +259,11 @@ typedef struct
 
 void serial_help(void);
 void save_ram(int slotnum);
-void unpack_ram(uint8_t *src);
+void mark_all_dirty(void);
+void store_status(void);
+void image_export(uint8_t *dest, int flags);
+int image_import(const uint8_t *src, int flags);
+void save_done(int ok);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -192,33 +272,16 @@ int keypress = 0;
 int parameter = 0;
 int address   = 0;
 
-////////////////////////////////////////////////////////////////////////////////
-
-//-----------------------------------------------------------------------------
-//
-// Put a value on the data out lines. Value is 4 LS bits of the rom array.
-
-inline void set_data(BYTE data)
-{
-  int states;
-  int dat = data & DATA_MASK;
-  
-  // Direct register access to make things faster
-  sio_hw->gpio_set = (  dat  << D0_PIN);
-  sio_hw->gpio_clr = ((dat ^ DATA_MASK) << D0_PIN);
-}
-
-// Only deals with DOUT pin
-inline void set_data_inputs(void)
-{
-  sio_hw->gpio_oe_clr = (DATA_MASK << D0_PIN);
-}
+// Core0's own accesses to the RAM image, 'b' shows them next to core1's
+// bus selects. PIO mode DMA reaches it without either core.
+#define CORE0_WRITE      0      // bytes stored by the CLI or an image load
+#define CORE0_READ       1      // bytes copied out for a save or a dump
+#define CORE0_BUSY       2      // stores given up, core1 didn't pause
+#define CORE0_NUM_CLASS  3
 
-inline void set_data_outputs(void)
-{
-  sio_hw->gpio_oe_set = (DATA_MASK<<D0_PIN);
-}
+volatile uint32_t core0_count[CORE0_NUM_CLASS];
 
+////////////////////////////////////////////////////////////////////////////////
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -227,248 +290,144 @@ inline void set_data_outputs(void)
 //
 ////////////////////////////////////////////////////////////////////////////////
 
-#define MAX_ADDR_TRACE 2000
-
 volatile int trace_on = 0;
-volatile int addr_trace_index = 0;
-volatile uint16_t addr_trace[MAX_ADDR_TRACE];
-volatile uint8_t  data_trace[MAX_ADDR_TRACE];
-volatile uint8_t    ce_trace[MAX_ADDR_TRACE];
+volatile int trace_streaming = 0;
+TRACE_RING trace_ring;
 
-volatile uint8_t  flag_trace[MAX_ADDR_TRACE];
 volatile unsigned int number_ce_assert = 0;
 
-#define FLAG_WRITE 1
-#define FLAG_READ  2
-
-////////////////////////////////////////////////////////////////////////////////
-//
-// Emulate a RAM chip
-//
-////////////////////////////////////////////////////////////////////////////////
+#if NUM_CE > 4
+#error Trace records have two bits of chip
+#endif
 
-#define EM_USB 0
+// Trace trigger, see cli_set_trigger(). Each stage is a comparator, the
+// trigger fires when they have matched in order. Core0 sets the stages up
+// while it's off, core1 steps through them.
+#define TRIGGER_STAGES  4
 
+#define TRIGGER_OFF     0
+#define TRIGGER_ARMED   1       // waiting for the stages to match
+#define TRIGGER_FIRED   2       // tracing the events after
+#define TRIGGER_DONE    3       // tracing stopped, window in the ring
 
-void ram_emulate(void)
+typedef struct
 {
-  //printf("\nEmulating RAM...");
-
-  irq_set_mask_enabled( 0xFFFFFFFF, 0 );
-
-  while(1)
+  // As given, -1 for any
+  int chip;
+  int lo;               // canonical addresses
+  int hi;
+  int data;
+  int write;
+
+  // What core1 tests
+  uint32_t mask;        // record bits that must be value
+  uint32_t value;
+  uint32_t bus_lo;      // bus address range
+  uint32_t bus_span;
+} TRIGGER_STAGE;
+
+TRIGGER_STAGE trigger_stage[TRIGGER_STAGES];
+int trigger_stages = 0;
+uint32_t trigger_pre;
+uint32_t trigger_post;
+
+volatile int trigger_state = TRIGGER_OFF;
+volatile int trigger_matched;
+volatile uint32_t trigger_seq;  // record number of the event that fired it
+
+// Core1, after each traced cycle while the trigger is on
+static inline void trigger_check(uint32_t rec)
+{
+  if( trigger_state == TRIGGER_ARMED )
     {
-      uint32_t gpio_states;
-      BYTE db;
-      unsigned int addr;
-      
-      // We look for CE low
-      if( ((gpio_states = sio_hw->gpio_in) & (CE_MASK << CE0_PIN)) == (CE_MASK << CE0_PIN) )
-      	{
-	  // S high, we are not selected
-	  // Data lines inputs
-	  set_data_inputs();
-      	}
-      else
-      	{
-	  // CE low, we are selected
+      TRIGGER_STAGE *t = &trigger_stage[trigger_matched];
 
-	  // Get the select number
-	  int selbits = (gpio_states & (CE_MASK << CE0_PIN)) >> CE0_PIN;
-	  int selnum = 4;
-
-	  switch(selbits)
+      if( ((rec & t->mask) == t->value) && ((TRACE_ADDR(rec) - t->bus_lo) <= t->bus_span) )
+	{
+	  if( ++trigger_matched == trigger_stages )
 	    {
-	    case 0x0e:
-	      selnum = 0;
-	      break;
+	      trigger_seq = trace_ring.head - 1;
+	      trigger_state = TRIGGER_FIRED;
+	    }
+	}
+    }
 
-	    case 0x0D:
-	      selnum = 1;
-	      break;
+  if( (trigger_state == TRIGGER_FIRED) && ((trace_ring.head - trigger_seq) > trigger_post) )
+    {
+      trace_on = 0;
+      trigger_state = TRIGGER_DONE;
+    }
+}
 
-	    case 0x0B:
-	      selnum = 2;
-	      break;
+// Trace a bus cycle, inlined in ram_emulate(). Core1 only ever adds to
+// the ring, core0 reads it back.
+#define BUS_TRACE(SEL, ADDR, DATA, FLAG)					\
+  if( trace_on )								\
+    {										\
+      uint32_t rec = TRACE_REC((SEL), (ADDR), (DATA), (FLAG) == FLAG_WRITE);	\
+										\
+      trace_ring_put(&trace_ring, rec);						\
+      if( trigger_state != TRIGGER_OFF )					\
+	{									\
+	  trigger_check(rec);							\
+	}									\
+    }
 
-	    case 0x07:
-	      selnum = 3;
-	      break;
-	    }
+// Watchpoints, see cli_watch(). A bit per nibble of the RAM, in bus
+// order. Core1 tests it on every write and queues the writes that change
+// a watched nibble for core0 to report.
+#define WATCH_QUEUE_SIZE  32            // a power of two
 
-#if EM_USB
-	  printf("\nSEL %d", selnum);
-#endif
-	  // We have to monitor W for a write pulse
-	  // if we see it then we write the data on the rising edge of W
-	  // While W is high we treat this as a read and present data
+typedef struct
+{
+  uint32_t time;        // time_us_32() of the write
+  uint16_t n;           // nibble index
+  uint8_t was;          // as the bus carries them
+  uint8_t now;
+} WATCH_EVENT;
 
-	  while(1)
-	    {
-	      gpio_states = sio_hw->gpio_in;
+volatile uint32_t watch_map[ROM_SIZE / 32];
 
-	      addr = ADDRESS_MASK ^ ((gpio_states >> A0_PIN) & ADDRESS_MASK);
-	      
-	      // Is this a read or a write?
-	      if( (gpio_states & ( 1<< W_PIN))==0 )
-		{
+WATCH_EVENT watch_queue[WATCH_QUEUE_SIZE];
+uint32_t watch_head = 0;        // core1 only
+uint32_t watch_tail = 0;        // core0 only
+uint32_t watch_lost = 0;
 
-		  // Write
-		  // data lines inputs
-		  set_data_inputs();
-		  
-		  // Wait for W to go high then latch data
-
-		  while( ((gpio_states = sio_hw->gpio_in) & (1 << W_PIN))==0 )
-		    {
-		    }
-		  
-		  // We have 4 bits of data to store, they are read from the Dn pins
-		  rom_data[addr+selnum*RAM_CE_SIZE] = ((gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN);
-
-		  if( trace_on )
-		    {
-		      ce_trace[addr_trace_index] = selnum;
-		      addr_trace[addr_trace_index] = addr;
-		      data_trace[addr_trace_index] = rom_data[addr+selnum*RAM_CE_SIZE];
-		      flag_trace[addr_trace_index] = FLAG_WRITE;
-		      addr_trace_index++;
-		      if( addr_trace_index == MAX_ADDR_TRACE )
-			{
-			  trace_on = 0;
-			}
-		      
-		      addr_trace_index = addr_trace_index % MAX_ADDR_TRACE;
-		    }
-		  
-		  while( ((gpio_states = sio_hw->gpio_in) & (CE_MASK << CE0_PIN)) != (CE_MASK << CE0_PIN) )
-		    {
-		    }
-
-#if EM_USB
-		  printf("\nWR %04X %01X", addr, (gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN);
-#endif
-		}
-	      else
-		{
+// Core1, a write to a watched nibble
+static inline void watch_hit(unsigned int n, unsigned int was, unsigned int now)
+{
+  if( was != now )
+    {
+      uint32_t h = watch_head;
+      WATCH_EVENT *e = &watch_queue[h & (WATCH_QUEUE_SIZE - 1)];
+
+      e->time = time_us_32();
+      e->n = n;
+      e->was = was;
+      e->now = now;
+      __atomic_store_n(&watch_head, h + 1, __ATOMIC_RELEASE);
+    }
+}
 
-		  // Read
-		  // If we are tracing then we sample the read value for tracing
-		  
-		  // make DOUT an output
-#if !TRACE_ONLY		  
-		  set_data_outputs();
-
-		  // ROM emulation so always a read of us
-		  // get address
-		  //addr = (gpio_states >> A0_PIN) & ADDRESS_MASK;
-
-
-		  // Get data and present it on bus (single bit)
-		  set_data(rom_data[addr+selnum*RAM_CE_SIZE]);
-#endif	  
-		  if( trace_on )
-		    {
-		      ce_trace[addr_trace_index] = selnum;
-		      addr_trace[addr_trace_index] = addr;
-#if TRACE_ONLY
-		 
-		      data_trace[addr_trace_index] =  ((gpio_states & (DATA_MASK << D0_PIN))>>D0_PIN);
-#else
-		      data_trace[addr_trace_index] = rom_data[addr+selnum*RAM_CE_SIZE];
-#endif
-		      flag_trace[addr_trace_index] = FLAG_READ;
-		      addr_trace_index++;
-		      if( addr_trace_index == MAX_ADDR_TRACE )
-			{
-			  trace_on = 0;
-			}
-		      
-		      addr_trace_index = addr_trace_index % MAX_ADDR_TRACE;
-
-		    }
-		  
-		  while( ((gpio_states = sio_hw->gpio_in) & (CE_MASK << CE0_PIN)) != (CE_MASK << CE0_PIN) )
-		    {
-		    }
-		  
-#if EM_USB
-		  printf("\nRD %04X %01X", addr, rom_data[addr+selnum*RAM_CE_SIZE]);
-#endif		  
-		  //set_data(0xF8);
-		}
+// Inlined in ram_emulate(), an unwatched write costs the bit test
+#define BUS_WATCH(N, DATA)						\
+  if( watch_map[(N) >> 5] & (1u << ((N) & 31)) )				\
+    {									\
+      watch_hit((N), RAM_NIBBLE(N), (DATA));				\
+    }
 
-	      if( ((gpio_states = sio_hw->gpio_in) & (CE_MASK << CE0_PIN)) == (CE_MASK << CE0_PIN) )
-		//if( gpio_states & (1 << CE_PIN) )
-		{
-		  // S gone high, exit the loop
-		  // Delay for 100ns or so as the real 4044 does this
-		  // and data is available for up to 100ns after CE rises.
-#if 1
-		  for(volatile int d=0; d<100; d++)
-		    {
-		    }
-#endif		  
-		  set_data_inputs();
-#if EM_USB
-		  printf("\nDesel");
-#endif
-		  break;
-		}
+////////////////////////////////////////////////////////////////////////////////
+//
+// Emulate the RAM chips, see upd444_engine.h
+//
+////////////////////////////////////////////////////////////////////////////////
 
-	    }
-#if 0	  
-	  // Trace address
-	  if( addr == 3 )
-	    {
-	      trace_on = 1;
-	    }
-	  
-	  if( trace_on)
-	    {
-	      if( addr_trace_index < MAX_ADDR_TRACE )
-		{
-		  int tv = addr;
-		  if( addr_trace[addr_trace_index] == tv )
-		    {
-		    }
-		  else
-		    {
-		      addr_trace_index++;
-		      addr_trace[addr_trace_index] = tv;
-		    }
-		  //addr_trace_index %= MAX_ADDR_TRACE;
-		  
-		}
-	    }
-	  number_ce_assert++;
+#define EM_USB 0
 
-#endif
-#if 1
-	  
-	  // Wait for CE to be de-asserted
-	  while(1)
-	    {
-	      // S high, we are not selected
-	      // data lines inputs
-	      gpio_states = sio_hw->gpio_in;
-	      //printf("\nWAIT %08X", gpio_states);
-	      //printf("  %02X", gpio_get(CE_PIN));
-	      // We look for S
-	      if( (gpio_states & (CE_MASK << CE0_PIN)) == (CE_MASK << CE0_PIN) )
-		//if( gpio_states & (1 << CE_PIN) )
-		{
-		  // S high, we are not selected
-		  // data lines inputs
-		  set_data_inputs();
-		  //printf("\nDONE WAIT");
-		  break;
-		}
-	    }
-#endif
-	}
-    }
-}
+// Core0 stops the loop to write to the RAM, see SET_RAM_NIBBLE()
+#define BUS_PAUSE 1
+
+#include "upd444_engine.h"
 
 void set_gpio_input(int gpio_pin)
 {
@@ -483,6 +442,82 @@ void set_gpio_output(int gpio_pin)
   gpio_set_dir(gpio_pin, GPIO_OUT);
 }
 
+#if PIO_BUS_ENGINE
+////////////////////////////////////////////////////////////////////////////////
+//
+// PIO and DMA bus engine
+//
+// One state machine serves reads, one latches writes. Each hands addresses
+// to a pair of DMA channels, the first of which re-triggers the second with
+// the address of the nibble. No CPU time is used once this has been called,
+// core1 is left free.
+//
+// CE falling to data driven is 21 to 25 cycles with the DMA uncontended,
+// 78 to 93ns at 270MHz. host_tools/pio_bus_model.c has the breakdown.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define PIO_BUS      pio0
+#define PIO_SM_READ  0
+#define PIO_SM_WRITE 1
+
+void pio_bus_init(void)
+{
+  PIO pio = PIO_BUS;
+  uint32_t image_base = (uint32_t)rom_data;
+
+  uint read_offset  = pio_add_program(pio, &upd444_read_program);
+  uint write_offset = pio_add_program(pio, &upd444_write_program);
+
+  upd444_read_program_init(pio, PIO_SM_READ, read_offset, A0_PIN, D0_PIN, W_PIN, image_base);
+  upd444_write_program_init(pio, PIO_SM_WRITE, write_offset, A0_PIN, image_base);
+
+  int read_addr_chan  = dma_claim_unused_channel(true);
+  int read_data_chan  = dma_claim_unused_channel(true);
+  int write_addr_chan = dma_claim_unused_channel(true);
+  int write_data_chan = dma_claim_unused_channel(true);
+  dma_channel_config c;
+
+  // Read: address from the RX FIFO becomes the read address of the data channel
+  c = dma_channel_get_default_config(read_addr_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, PIO_SM_READ, false));
+  dma_channel_configure(read_addr_chan, &c, &dma_hw->ch[read_data_chan].al3_read_addr_trig, &pio->rxf[PIO_SM_READ], 1, false);
+
+  // The nibble goes back to the state machine, then re-arm the address channel
+  c = dma_channel_get_default_config(read_data_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_chain_to(&c, read_addr_chan);
+  dma_channel_configure(read_data_chan, &c, &pio->txf[PIO_SM_READ], rom_data, 1, false);
+
+  // Write: address from the RX FIFO becomes the write address of the data channel
+  c = dma_channel_get_default_config(write_addr_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_32);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, PIO_SM_WRITE, false));
+  dma_channel_configure(write_addr_chan, &c, &dma_hw->ch[write_data_chan].al2_write_addr_trig, &pio->rxf[PIO_SM_WRITE], 1, false);
+
+  // The data word follows the address in the same FIFO, low byte holds the nibble
+  c = dma_channel_get_default_config(write_data_chan);
+  channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+  channel_config_set_read_increment(&c, false);
+  channel_config_set_write_increment(&c, false);
+  channel_config_set_dreq(&c, pio_get_dreq(pio, PIO_SM_WRITE, false));
+  channel_config_set_chain_to(&c, write_addr_chan);
+  dma_channel_configure(write_data_chan, &c, rom_data, &pio->rxf[PIO_SM_WRITE], 1, false);
+
+  dma_channel_start(read_addr_chan);
+  dma_channel_start(write_addr_chan);
+  
+  pio_set_sm_mask_enabled(pio, (1 << PIO_SM_READ) | (1 << PIO_SM_WRITE), true);
+}
+#endif
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //
@@ -517,19 +552,20 @@ char to_ascii(int ch)
 }
 
 
-#define NIBBLE(XXX) ((XXX & 0xF) ^ 0xF)
 #define BYTE_WIDTH   32
 
 void cli_dump_memory(void)
 {
   printf("\n\n");
-  char ascii[BYTE_WIDTH];
+  char ascii[BYTE_WIDTH+1] = "";
   char bc[10] = " ";
   char chr;
+
+  image_export(image_buf, IMAGE_CANONICAL);
   
-  for(int i=0; i<1024*4; i+=2)
+  for(int i=0; i<ROM_SIZE_BYTES; i++)
     {
-      if( (i % (BYTE_WIDTH * 2)) == 0 )
+      if( (i % BYTE_WIDTH) == 0 )
 	{
 	  if( i != 0 )
 	    {
@@ -537,11 +573,11 @@ void cli_dump_memory(void)
 	      ascii[0] = '\0';
 	    }
 	  
-	  printf("\n%04X: ", i/2);
+	  printf("\n%04X: ", i);
 	}
-      
-      printf(" %01X%01X", NIBBLE(rom_data[i+1]), NIBBLE(rom_data[i]));
-      chr = NIBBLE(rom_data[i+1]) * 16 + NIBBLE(rom_data[i]);
+
+      chr = image_buf[i];
+      printf(" %02X", image_buf[i]);
       if( isprint(chr) )
 	{
 	  bc[0] = to_ascii(chr);
@@ -560,6 +596,31 @@ void cli_dump_memory(void)
 }
 
 
+// The extents of the RAM that aren't cleared, and what they'd take to save
+void cli_regions(void)
+{
+  int pos = 0;
+  int n;
+  int count = 0;
+  int bytes = 0;
+
+  image_export(image_buf, IMAGE_CANONICAL);
+
+  printf("\n");
+  while( snap_extent(image_buf, ROM_SIZE_BYTES, RAM_CLEARED, &pos, &n) )
+    {
+      printf("\n%04X-%04X  %4d bytes", pos, pos+n-1, n);
+      count++;
+      bytes += n;
+      pos += n;
+    }
+
+  printf("\n\n%d extents, %d bytes. Sparse %d bytes, compressed %d bytes\n",
+	 count, bytes,
+	 snap_sparse_encode(snap_buf, sizeof(snap_buf), image_buf, ROM_SIZE_BYTES, RAM_CLEARED),
+	 snap_encode(snap_buf, sizeof(snap_buf), image_buf, ROM_SIZE_BYTES, &snap_state));
+}
+
 // Another digit pressed, update the parameter variable
 void cli_digit(void)
 {
@@ -584,89 +645,2727 @@ void cli_zero_parameter(void)
   parameter = 0;
 }
 
-void cli_start_trace(void)
+// Read a line of printable characters into buf, returns its length
+int read_line(char *buf, int size)
+{
+  int len = 0;
+
+  while( 1 )
+    {
+      int c = getchar_timeout_us(30000000);
+
+      if( (c == PICO_ERROR_TIMEOUT) || (c == '\r') || (c == '\n') )
+	{
+	  break;
+	}
+
+      if( (c == 8) || (c == 127) )
+	{
+	  if( len > 0 )
+	    {
+	      len--;
+	      printf("\b \b");
+	    }
+	  continue;
+	}
+
+      if( isprint(c) && (len < size - 1) )
+	{
+	  buf[len++] = c;
+	  putchar(c);
+	}
+    }
+
+  buf[len] = '\0';
+  return(len);
+}
+
+// Stop a triggered trace. Core1 only looks at the trigger while it's
+// tracing, so give it time to finish the cycle it's on.
+void trigger_off(void)
+{
+  if( trigger_state != TRIGGER_OFF )
+    {
+      trace_on = 0;
+      sleep_us(100);
+      trigger_state = TRIGGER_OFF;
+    }
+}
+
+// Starts a plain trace, or arms the trigger if there is one
+void cli_start_trace(void)
+{
+#if PIO_BUS_ENGINE
+  printf("\nTrace needs the core1 bus engine");
+#else
+  if( (trigger_stages > 0) && trace_streaming )
+    {
+      printf("\nThe trace is streaming on USB\n");
+      return;
+    }
+
+  trigger_off();
+  trace_ring_flush(&trace_ring);
+
+  if( trigger_stages > 0 )
+    {
+      trigger_matched = 0;
+      trigger_state = TRIGGER_ARMED;
+      printf("\nWaiting for trigger\n");
+    }
+
+  trace_on = 1;
+#endif
+}
+
+void cli_stop_trace(void)
+{
+  trace_on = 0;
+
+  // Once core1 is done with the cycle it's on, keep what there is of the
+  // window
+  sleep_us(100);
+  if( trigger_state == TRIGGER_FIRED )
+    {
+      trigger_state = TRIGGER_DONE;
+    }
+  else if( trigger_state == TRIGGER_ARMED )
+    {
+      trigger_state = TRIGGER_OFF;
+    }
+}
+
+// Print what has been traced since the last display, at most a ring's
+// worth. Core1 carries on tracing while this runs, anything it laps is
+// counted as lost.
+void cli_display_trace(void)
+{
+  static uint32_t rec[64];
+  uint32_t end = trace_ring.tail + TRACE_RING_SIZE;
+  uint32_t lost = trace_ring.lost;
+  int n;
+
+  if( trace_streaming )
+    {
+      printf("\nThe trace is streaming on USB\n");
+      return;
+    }
+
+  if( trigger_state == TRIGGER_ARMED )
+    {
+      printf("\nWaiting for trigger, %d of %d stages matched\n", trigger_matched, trigger_stages);
+      return;
+    }
+
+  if( trigger_state == TRIGGER_FIRED )
+    {
+      printf("\nTriggered, %u of %u events after\n", trace_ring.head - 1 - trigger_seq, trigger_post);
+      return;
+    }
+
+  if( trigger_state == TRIGGER_DONE )
+    {
+      // Core1 has stopped, skip to the start of the window
+      uint32_t start = trigger_seq - trigger_pre;
+
+      if( (int32_t)(start - trace_ring.tail) > 0 )
+	{
+	  trace_ring.tail = start;
+	}
+    }
+
+  while( ((int32_t)(end - trace_ring.tail) > 0) && ((n = trace_ring_read(&trace_ring, rec, sizeof(rec)/sizeof(rec[0]))) > 0) )
+    {
+      uint32_t seq = trace_ring.tail - n;
+
+      for(int i=0; i<n; i++)
+	{
+	  printf("\n%08u: %04X %01X %02X %c%s", seq + i,
+		 BUS_CANONICAL_ADDR(TRACE_ADDR(rec[i])),
+		 TRACE_CHIP(rec[i]),
+		 TRACE_DATA(rec[i]),
+		 TRACE_IS_WRITE(rec[i]) ? 'W' : 'R',
+		 ((trigger_state == TRIGGER_DONE) && (seq + i == trigger_seq)) ? "  <- trigger" : "");
+	}
+    }
+
+  printf("\n%s, %u lost\n", trace_on ? "Tracing" : "Stopped", trace_ring.lost - lost);
+}
+
+void trigger_show(void)
+{
+  if( trigger_stages == 0 )
+    {
+      printf("\nNo trigger, 'T' traces everything\n");
+      return;
+    }
+
+  printf("\nTrigger: pre %u post %u", trigger_pre, trigger_post);
+
+  for(int i=0; i<trigger_stages; i++)
+    {
+      TRIGGER_STAGE *t = &trigger_stage[i];
+
+      printf("%s", (i == 0) ? "\n  " : "\n  then ");
+
+      if( (t->chip < 0) && (t->data < 0) && (t->write < 0) && (t->lo == 0) && (t->hi == ADDRESS_MASK) )
+	{
+	  printf("any");
+	}
+
+      if( t->chip >= 0 )
+	{
+	  printf("chip %d ", t->chip);
+	}
+
+      if( t->lo == t->hi )
+	{
+	  printf("%03X ", t->lo);
+	}
+      else if( (t->lo != 0) || (t->hi != ADDRESS_MASK) )
+	{
+	  printf("%03X-%03X ", t->lo, t->hi);
+	}
+
+      if( t->data >= 0 )
+	{
+	  printf("data %X ", t->data);
+	}
+
+      if( t->write >= 0 )
+	{
+	  printf("%s", t->write ? "write" : "read");
+	}
+    }
+  printf("\n");
+}
+
+// Work out what core1 tests for a stage
+void trigger_compile(TRIGGER_STAGE *t)
+{
+  uint32_t a = BUS_CANONICAL_ADDR(t->lo);
+  uint32_t b = BUS_CANONICAL_ADDR(t->hi);
+
+  t->mask = 0;
+  t->value = 0;
+
+  if( t->chip >= 0 )
+    {
+      t->mask |= TRACE_REC(3, 0, 0, 0);
+      t->value |= TRACE_REC(t->chip, 0, 0, 0);
+    }
+
+  if( t->data >= 0 )
+    {
+      t->mask |= TRACE_REC(0, 0, 0xF, 0);
+      t->value |= TRACE_REC(0, 0, t->data, 0);
+    }
+
+  if( t->write >= 0 )
+    {
+      t->mask |= TRACE_WRITE;
+      t->value |= TRACE_REC(0, 0, 0, t->write);
+    }
+
+  // A canonical range is a bus range, backwards if the address is inverted
+  t->bus_lo = (a < b) ? a : b;
+  t->bus_span = (a < b) ? (b - a) : (a - b);
+}
+
+// Set the trigger, a line follows:
+//
+//   [pre N] [post M] stage [then stage ...]
+//
+// A stage is any of chip C, an address or range (hex, canonical, as 't'
+// shows them, e.g. 2F0 or 2F0-2FF), data D (hex) and read or write. A
+// stage with none of them matches any event. 'T' then traces until the
+// last stage has matched and M more events have been traced, leaving N
+// events before the one that matched for 't'. An empty line clears the
+// trigger.
+void cli_set_trigger(void)
+{
+  char line[80];
+  char *tok;
+  char *end;
+  TRIGGER_STAGE *t;
+  uint32_t pre = TRACE_RING_SIZE / 2;
+  uint32_t post = TRACE_RING_SIZE / 4;
+  int stages = 1;
+
+  printf("\nTrigger: ");
+  read_line(line, sizeof(line));
+
+  trigger_off();
+  trigger_stages = 0;
+
+  if( line[strspn(line, " ")] == '\0' )
+    {
+      trigger_show();
+      return;
+    }
+
+  t = &trigger_stage[0];
+  t->chip = t->data = t->write = -1;
+  t->lo = 0;
+  t->hi = ADDRESS_MASK;
+
+  for(tok = strtok(line, " "); tok != NULL; tok = strtok(NULL, " "))
+    {
+      if( (strcmp(tok, "pre") == 0) || (strcmp(tok, "post") == 0) || (strcmp(tok, "chip") == 0) || (strcmp(tok, "data") == 0) )
+	{
+	  char *arg = strtok(NULL, " ");
+	  long v;
+
+	  if( arg == NULL )
+	    {
+	      break;
+	    }
+
+	  v = strtol(arg, &end, (tok[0] == 'd') ? 16 : 10);
+	  if( (*end != '\0') || (v < 0) )
+	    {
+	      tok = arg;
+	      break;
+	    }
+
+	  // Each bounded on its own so the sum checked below can't wrap
+	  if( (tok[0] == 'p') && (v <= TRACE_RING_SIZE - 1) )
+	    {
+	      *((tok[1] == 'r') ? &pre : &post) = v;
+	    }
+	  else if( (tok[0] == 'c') && (v < NUM_CE) )
+	    {
+	      t->chip = v;
+	    }
+	  else if( (tok[0] == 'd') && (v <= 0xF) )
+	    {
+	      t->data = v;
+	    }
+	  else
+	    {
+	      tok = arg;
+	      break;
+	    }
+	}
+      else if( (strcmp(tok, "read") == 0) || (strcmp(tok, "write") == 0) )
+	{
+	  t->write = (tok[0] == 'w');
+	}
+      else if( strcmp(tok, "then") == 0 )
+	{
+	  if( stages == TRIGGER_STAGES )
+	    {
+	      break;
+	    }
+
+	  t = &trigger_stage[stages++];
+	  t->chip = t->data = t->write = -1;
+	  t->lo = 0;
+	  t->hi = ADDRESS_MASK;
+	}
+      else
+	{
+	  long lo = strtol(tok, &end, 16);
+	  long hi = lo;
+
+	  if( (end != tok) && (*end == '-') )
+	    {
+	      char *h = end + 1;
+
+	      hi = strtol(h, &end, 16);
+	      if( end == h )
+		{
+		  break;
+		}
+	    }
+
+	  if( (end == tok) || (*end != '\0') || (lo < 0) || (hi < lo) || (hi > ADDRESS_MASK) )
+	    {
+	      break;
+	    }
+
+	  t->lo = lo;
+	  t->hi = hi;
+	}
+    }
+
+  if( tok != NULL )
+    {
+      printf("\nBad trigger at '%s'\n", tok);
+      return;
+    }
+
+  // The window and the event that fired it have to fit in the ring
+  if( pre + post + 1 > TRACE_RING_SIZE )
+    {
+      printf("\npre and post add up to more than %d\n", TRACE_RING_SIZE - 1);
+      return;
+    }
+
+  for(int i=0; i<stages; i++)
+    {
+      trigger_compile(&trigger_stage[i]);
+    }
+
+  trigger_pre = pre;
+  trigger_post = post;
+  trigger_stages = stages;
+  trigger_show();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Trace streaming
+//
+// 'U' streams the trace to the host on the vendor interface (see
+// usb_descriptors.c and common/trace_stream.h) until it's given again.
+// Core0 takes records off the ring into one of two frames while the
+// other is on the endpoint, and the endpoint is handed the frame itself,
+// there's no FIFO in between. Frames are coded (common/trace_codec.h)
+// unless 'U' is given a parameter, when they're the records as they are.
+// TinyUSB runs in stdio_usb's background interrupt, so frames are passed
+// to it with usbd_defer_func().
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Longest a part filled frame waits for more records
+#define TRACE_FRAME_US  10000
+
+#define FRAME_FREE      0
+#define FRAME_FILLED    1       // waiting for the endpoint
+#define FRAME_BUSY      2       // on the endpoint
+
+uint8_t trace_frame[2][TRACE_FRAME_BYTES] __attribute__((aligned(4)));
+volatile uint8_t trace_frame_state[2];
+
+// Core0 fills one, TinyUSB sends the other
+int trace_frame_fill = 0;
+int trace_frame_send = 0;
+int trace_frame_open = 0;
+uint32_t trace_frame_start;
+
+// Records off the ring, waiting for a frame
+#define TRACE_STAGE_SIZE  64
+
+uint32_t trace_stage[TRACE_STAGE_SIZE];
+int trace_stage_count = 0;
+int trace_stage_next = 0;
+uint32_t trace_stage_seq;
+
+// Coded frames, see common/trace_codec.h
+int trace_stream_coded = 1;
+TRACE_CODEC trace_codec;
+
+uint32_t trace_stream_frames;
+uint32_t trace_stream_stalls;
+uint32_t trace_stream_discarded;
+int trace_stream_stalled;
+
+// Set by a USB reset, the next frame is a key frame
+volatile int trace_stream_resync = 0;
+
+// Zero until the host configures the interface
+uint8_t trace_ep = 0;
+
+// In TinyUSB's context
+void trace_stream_send(void *param)
+{
+  (void)param;
+
+  if( (trace_ep != 0) && !usbd_edpt_busy(0, trace_ep) && (trace_frame_state[trace_frame_send] == FRAME_FILLED) )
+    {
+      if( usbd_edpt_xfer(0, trace_ep, trace_frame[trace_frame_send], TRACE_FRAME_BYTES) )
+	{
+	  trace_frame_state[trace_frame_send] = FRAME_BUSY;
+	}
+    }
+}
+
+void trace_usb_init(void)
+{
+}
+
+void trace_usb_reset(uint8_t rhport)
+{
+  (void)rhport;
+
+  // Anything queued or in flight is gone, the host sees the gap in seq
+  trace_ep = 0;
+  trace_stream_resync = 1;
+
+  for(int i=0; i<2; i++)
+    {
+      if( trace_frame_state[i] != FRAME_FREE )
+	{
+	  trace_stream_discarded += ((TRACE_FRAME *)trace_frame[i])->count;
+	  trace_frame_state[i] = FRAME_FREE;
+	}
+    }
+  trace_frame_send = trace_frame_fill;
+}
+
+uint16_t trace_usb_open(uint8_t rhport, tusb_desc_interface_t const *itf, uint16_t max_len)
+{
+  tusb_desc_endpoint_t const *ep = (tusb_desc_endpoint_t const *)tu_desc_next(itf);
+  uint16_t len = sizeof(tusb_desc_interface_t) + sizeof(tusb_desc_endpoint_t);
+
+  TU_VERIFY((itf->bInterfaceClass == TUSB_CLASS_VENDOR_SPECIFIC) && (itf->bInterfaceSubClass == TRACE_USB_SUBCLASS), 0);
+  TU_VERIFY((itf->bNumEndpoints == 1) && (max_len >= len), 0);
+  TU_ASSERT(usbd_edpt_open(rhport, ep), 0);
+
+  trace_ep = ep->bEndpointAddress;
+  trace_stream_send(NULL);
+  return(len);
+}
+
+bool trace_usb_control(uint8_t rhport, uint8_t stage, tusb_control_request_t const *request)
+{
+  (void)rhport;
+  (void)stage;
+  (void)request;
+
+  return(false);
+}
+
+bool trace_usb_xfer(uint8_t rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
+{
+  (void)rhport;
+  (void)ep_addr;
+  (void)result;
+  (void)xferred_bytes;
+
+  trace_frame_state[trace_frame_send] = FRAME_FREE;
+  trace_frame_send ^= 1;
+  trace_stream_send(NULL);
+  return(true);
+}
+
+const usbd_class_driver_t trace_usb_driver =
+  {
+#if CFG_TUSB_DEBUG >= 2
+   .name            = "TRACE",
+#endif
+   .init            = trace_usb_init,
+   .reset           = trace_usb_reset,
+   .open            = trace_usb_open,
+   .control_xfer_cb = trace_usb_control,
+   .xfer_cb         = trace_usb_xfer,
+   .sof             = NULL,
+  };
+
+usbd_class_driver_t const *usbd_app_driver_get_cb(uint8_t *driver_count)
+{
+  *driver_count = 1;
+  return(&trace_usb_driver);
+}
+
+// Start a frame with the record numbered seq
+void trace_frame_begin(uint32_t seq)
+{
+  TRACE_FRAME *f = (TRACE_FRAME *)trace_frame[trace_frame_fill];
+
+  f->seq = seq;
+  f->count = 0;
+  f->bytes = 0;
+  f->format = TRACE_FORMAT_RAW;
+
+  if( trace_stream_coded )
+    {
+      int key = trace_stream_resync || (trace_stream_frames % TRACE_KEY_FRAMES) == 0;
+
+      f->format = key ? TRACE_FORMAT_KEY : TRACE_FORMAT_CODED;
+      trace_codec_start(&trace_codec, key);
+    }
+  trace_stream_resync = 0;
+
+  trace_frame_start = time_us_32();
+  trace_frame_open = 1;
+}
+
+// Add a record, returns 0 if the frame is full and it wasn't
+int trace_frame_add(uint32_t rec)
+{
+  TRACE_FRAME *f = (TRACE_FRAME *)trace_frame[trace_frame_fill];
+  uint8_t *payload = (uint8_t *)(f+1);
+
+  if( f->bytes + (trace_stream_coded ? TRACE_ENCODE_MAX : sizeof(rec)) > TRACE_FRAME_PAYLOAD )
+    {
+      return(0);
+    }
+
+  if( trace_stream_coded )
+    {
+      f->bytes += trace_encode(&trace_codec, payload + f->bytes, rec);
+    }
+  else
+    {
+      memcpy(payload + f->bytes, &rec, sizeof(rec));
+      f->bytes += sizeof(rec);
+    }
+
+  f->count++;
+  return(1);
+}
+
+// Finish the frame being filled and queue it
+void trace_stream_ship(void)
+{
+  TRACE_FRAME *f = (TRACE_FRAME *)trace_frame[trace_frame_fill];
+  uint8_t *payload = (uint8_t *)(f+1);
+
+  if( trace_stream_coded )
+    {
+      f->bytes += trace_encode_flush(&trace_codec, payload + f->bytes);
+    }
+
+  f->magic   = TRACE_FRAME_MAGIC;
+  f->version = TRACE_FRAME_VERSION;
+  f->lost    = trace_ring.lost + trace_stream_discarded;
+  f->stalls  = trace_stream_stalls;
+  memset(payload + f->bytes, 0, TRACE_FRAME_PAYLOAD - f->bytes);
+
+  trace_frame_state[trace_frame_fill] = FRAME_FILLED;
+  trace_frame_fill ^= 1;
+  trace_frame_open = 0;
+  trace_stream_frames++;
+
+  usbd_defer_func(trace_stream_send, NULL, false);
+}
+
+// Called from the main loop
+void trace_stream_poll(void)
+{
+  TRACE_FRAME *f = (TRACE_FRAME *)trace_frame[trace_frame_fill];
+
+  if( !trace_streaming )
+    {
+      return;
+    }
+
+  if( trace_frame_state[trace_frame_fill] != FRAME_FREE )
+    {
+      // The host isn't keeping up, the ring takes the strain
+      if( !trace_stream_stalled && (trace_ring.head != trace_ring.tail) )
+	{
+	  trace_stream_stalls++;
+	  trace_stream_stalled = 1;
+	}
+      return;
+    }
+  trace_stream_stalled = 0;
+
+  if( trace_stream_resync && trace_frame_open && trace_stream_coded )
+    {
+      // The USB was reset and the frames queued before it are gone. This
+      // one's coding could depend on them, start again with a key frame.
+      trace_stream_discarded += f->count;
+      trace_frame_open = 0;
+    }
+
+  while( 1 )
+    {
+      uint32_t seq;
+
+      if( trace_stage_next == trace_stage_count )
+	{
+	  trace_stage_count = trace_ring_read(&trace_ring, trace_stage, TRACE_STAGE_SIZE);
+	  trace_stage_next = 0;
+	  trace_stage_seq = trace_ring.tail - trace_stage_count;
+
+	  if( trace_stage_count == 0 )
+	    {
+	      break;
+	    }
+	}
+
+      seq = trace_stage_seq + trace_stage_next;
+
+      if( !trace_frame_open )
+	{
+	  trace_frame_begin(seq);
+	}
+      else if( seq != f->seq + f->count )
+	{
+	  // The ring lapped us, a frame's records are consecutive
+	  trace_stream_ship();
+	  return;
+	}
+
+      if( !trace_frame_add(trace_stage[trace_stage_next]) )
+	{
+	  trace_stream_ship();
+	  return;
+	}
+      trace_stage_next++;
+    }
+
+  if( trace_frame_open && (f->count > 0) && ((time_us_32() - trace_frame_start) > TRACE_FRAME_US) )
+    {
+      trace_stream_ship();
+    }
+}
+
+void cli_trace_stream(void)
+{
+#if PIO_BUS_ENGINE
+  printf("\nTrace needs the core1 bus engine");
+#else
+  if( trace_streaming )
+    {
+      trace_on = 0;
+      trace_streaming = 0;
+
+      if( trace_frame_open )
+	{
+	  trace_stream_ship();
+	}
+
+      printf("\nStreaming stopped, %u frames, %u lost, %u stalls\n", trace_stream_frames, trace_ring.lost + trace_stream_discarded, trace_stream_stalls);
+      return;
+    }
+
+  if( trace_ep == 0 )
+    {
+      printf("\nThe trace interface isn't configured\n");
+      return;
+    }
+
+  // Frames still queued from before are left to go first
+  trace_frame_fill = trace_frame_send;
+  if( trace_frame_state[trace_frame_fill] != FRAME_FREE )
+    {
+      trace_frame_fill ^= 1;
+    }
+  trace_frame_open = 0;
+
+  trace_stream_coded = (parameter == 0);
+  trace_stream_frames = 0;
+  trace_stream_stalls = 0;
+  trace_stream_discarded = 0;
+  trace_stream_stalled = 0;
+  trace_stage_count = 0;
+  trace_stage_next = 0;
+  trigger_off();
+  trace_ring_flush(&trace_ring);
+
+  trace_streaming = 1;
+  trace_on = 1;
+  printf("\nStreaming %s trace on USB interface %d\n", trace_stream_coded ? "coded" : "raw", TRACE_USB_INTERFACE);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Watchpoints
+//
+// 'v' watches the byte at the address, as 'd' shows it, and every change
+// core1 sees the FX702P make to it is printed as the main loop finds it.
+// Writes of the value already there aren't reported. If core0 falls more
+// than WATCH_QUEUE_SIZE changes behind the oldest are lost, and counted.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// Nibble index of the low (i = 0) or high nibble of canonical byte a
+int watch_nibble(int a, int i)
+{
+  int chip = a / RAM_IMAGE_CHIP_BYTES;
+  int c = (a % RAM_IMAGE_CHIP_BYTES) * 2 + i;
+
+  return( chip * RAM_CE_SIZE + BUS_CANONICAL_ADDR(c) );
+}
+
+int watched(int n)
+{
+  return( (watch_map[n >> 5] & (1u << (n & 31))) != 0 );
+}
+
+// Called from the main loop
+void watch_poll(void)
+{
+  // Only what's there now, so a busy nibble can't keep us here
+  uint32_t end = __atomic_load_n(&watch_head, __ATOMIC_ACQUIRE);
+  uint32_t head;
+
+  while( (int32_t)(end - watch_tail) > 0 )
+    {
+      WATCH_EVENT e = watch_queue[watch_tail & (WATCH_QUEUE_SIZE - 1)];
+      int chip = e.n / RAM_CE_SIZE;
+      int c = BUS_CANONICAL_ADDR(e.n % RAM_CE_SIZE);
+
+      // The put after head overwrites the oldest before head moves
+      head = __atomic_load_n(&watch_head, __ATOMIC_ACQUIRE);
+      if( head - watch_tail >= WATCH_QUEUE_SIZE )
+	{
+	  uint32_t gone = head + 1 - WATCH_QUEUE_SIZE - watch_tail;
+
+	  printf("\nWatch: %u changes lost", gone);
+	  watch_lost += gone;
+	  watch_tail += gone;
+	  continue;
+	}
+      watch_tail++;
+
+      // Data in true polarity, as 'd' shows it
+      printf("\nWatch %04X %s: %X -> %X at %u.%06u",
+	     chip * RAM_IMAGE_CHIP_BYTES + c / 2,
+	     (c & 1) ? "high" : "low",
+	     e.was ^ DATA_MASK,
+	     e.now ^ DATA_MASK,
+	     e.time / 1000000,
+	     e.time % 1000000);
+    }
+}
+
+// Watch the byte at address, or stop watching it
+void cli_watch(void)
+{
+#if PIO_BUS_ENGINE
+  printf("\nWatchpoints need the core1 bus engine");
+#else
+  int on;
+
+  if( (address < 0) || (address >= ROM_SIZE_BYTES) )
+    {
+      printf("\nAddress out of range\n");
+      return;
+    }
+
+  on = !watched(watch_nibble(address, 0));
+
+  for(int i=0; i<2; i++)
+    {
+      int n = watch_nibble(address, i);
+
+      if( on )
+	{
+	  watch_map[n >> 5] |= (1u << (n & 31));
+	}
+      else
+	{
+	  watch_map[n >> 5] &= ~(1u << (n & 31));
+	}
+    }
+
+  printf("\n%s %04X\n", on ? "Watching" : "Stopped watching", address);
+#endif
+}
+
+// List the bytes watched, or with parameter 1 stop watching them all
+void cli_watch_list(void)
+{
+  int count = 0;
+
+  if( parameter == 1 )
+    {
+      for(int i=0; i<sizeof(watch_map)/sizeof(watch_map[0]); i++)
+	{
+	  watch_map[i] = 0;
+	}
+      printf("\nNothing watched\n");
+      return;
+    }
+
+  printf("\nWatching:");
+  for(int a=0; a<ROM_SIZE_BYTES; a++)
+    {
+      if( watched(watch_nibble(a, 0)) )
+	{
+	  printf("%s%04X", ((count++ % 16) == 0) ? "\n  " : " ", a);
+	}
+    }
+
+  if( count == 0 )
+    {
+      printf(" nothing");
+    }
+
+  printf("\n%u changes lost\n", watch_lost);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus latency under core0 load
+//
+// Runs the FX702P for a while with core0 quiet, then again with core0
+// flooding USB stdio, and prints the worst case CE to data time seen by
+// core1 for each. The calculator has to be running something that reads
+// RAM (a program or just the cursor) for there to be any reads.
+//
+// Worst case is the longest gap between idle samples (CE can fall just
+// after one) plus the longest time from the sample that saw CE low to the
+// data being driven. The input synchronisers add two more cycles.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define LATENCY_TEST_MS  2000
+
+#if BUS_LATENCY_STATS
+// Have core1 clear the stats, wait while core0 does something, take a copy
+void latency_run(LAT_STATS *l, int busy)
+{
+  lat_clear = 1;
+  while( lat_clear )
+    {
+    }
+
+  absolute_time_t end = make_timeout_time_ms(LATENCY_TEST_MS);
+  
+  while( absolute_time_diff_us(get_absolute_time(), end) > 0 )
+    {
+      if( busy )
+	{
+	  printf("\r0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF0123456789ABCDEF");
+	}
+    }
+
+  memcpy(l, (LAT_STATS *)&lat, sizeof(LAT_STATS));
+}
+
+uint32_t cycles_to_ns(uint32_t cycles)
+{
+  return((uint32_t)(cycles * 1000000000ULL / clock_get_hz(clk_sys)));
+}
+
+void latency_report(char *title, LAT_STATS *l)
+{
+  uint32_t worst = l->poll_max + l->max[LAT_CE_DATA] + 2;
+  
+  printf("\n%-10s %8d reads  poll gap %4d  read %4d  worst %4d cycles (%dns)",
+	 title,
+	 l->reads,
+	 l->poll_max,
+	 l->max[LAT_CE_DATA],
+	 worst,
+	 cycles_to_ns(worst));
+}
+#endif
+
+void cli_latency_test(void)
+{
+#if PIO_BUS_ENGINE || !BUS_LATENCY_STATS
+  printf("\nNeeds the core1 bus engine and BUS_LATENCY_STATS");
+#else
+  LAT_STATS quiet, busy;
+  
+  printf("\nMeasuring with core0 quiet...");
+  stdio_flush();
+  latency_run(&quiet, 0);
+  
+  printf("\nMeasuring with core0 busy on USB...\n");
+  latency_run(&busy, 1);
+
+  latency_report("Quiet", &quiet);
+  latency_report("USB busy", &busy);
+  printf("\n");
+#endif
+}
+
+#if BUS_LATENCY_STATS
+char *lat_names[LAT_NUM] =
+  {
+   "CE low to data driven",
+   "Data driven to CE high",
+   "CE low time",
+  };
+#endif
+
+// Print the histograms gathered since the last clear, then clear them
+void cli_latency_histogram(void)
+{
+#if PIO_BUS_ENGINE || !BUS_LATENCY_STATS
+  printf("\nNeeds the core1 bus engine and BUS_LATENCY_STATS");
+#else
+  LAT_STATS l;
+  
+  memcpy(&l, (LAT_STATS *)&lat, sizeof(LAT_STATS));
+  lat_clear = 1;
+
+  printf("\n%d reads, %d writes at %dMHz", l.reads, l.writes, clock_get_hz(clk_sys) / 1000000);
+  
+  for(int h=0; h<LAT_NUM; h++)
+    {
+      printf("\n\n%s, max %d cycles (%dns)", lat_names[h], l.max[h], cycles_to_ns(l.max[h]));
+      
+      for(int b=0; b<LAT_BUCKETS; b++)
+	{
+	  if( l.hist[h][b] != 0 )
+	    {
+	      printf("\n  >=%7d cycles %7dns  %10d", lat_bucket_low(b), cycles_to_ns(lat_bucket_low(b)), l.hist[h][b]);
+	    }
+	}
+    }
+
+  uint32_t worst = l.poll_max + l.max[LAT_CE_DATA] + 2;
+  
+  printf("\n\nLongest poll gap %d cycles, worst CE to data %d cycles (%dns)", l.poll_max, worst, cycles_to_ns(worst));
+  if( l.reads != 0 )
+    {
+      printf("\nFewest CE wait passes after a read %d", l.spin_min);
+    }
+  printf("\n");
+#endif
+}
+
+// Binary dump of the histograms for host_tools/latency_hist
+void cli_latency_dump(void)
+{
+#if PIO_BUS_ENGINE || !BUS_LATENCY_STATS
+  printf("\nNeeds the core1 bus engine and BUS_LATENCY_STATS");
+#else
+  LAT_DUMP_HEADER hdr;
+  LAT_STATS l;
+  
+  memcpy(&l, (LAT_STATS *)&lat, sizeof(LAT_STATS));
+
+  hdr.magic   = LAT_DUMP_MAGIC;
+  hdr.version = LAT_DUMP_VERSION;
+  hdr.buckets = LAT_BUCKETS;
+  hdr.sys_hz  = clock_get_hz(clk_sys);
+  hdr.build   = (SCRATCH_BUS_ENGINE ? LAT_BUILD_SCRATCH : 0) | (SPECULATIVE_READ ? LAT_BUILD_SPECULATIVE : 0);
+  hdr.length  = sizeof(LAT_STATS);
+
+  // Raw, no CR/LF translation
+  stdio_flush();
+  for(int i=0; i<sizeof(hdr); i++)
+    {
+      putchar_raw(((uint8_t *)&hdr)[i]);
+    }
+  for(int i=0; i<sizeof(l); i++)
+    {
+      putchar_raw(((uint8_t *)&l)[i]);
+    }
+  stdio_flush();
+#endif
+}
+
+void cli_speculation_stats(void)
+{
+#if SPECULATIVE_READ && !PIO_BUS_ENGINE
+  uint32_t hits = spec_hits;
+  uint32_t misses = spec_misses;
+  uint32_t reads = hits + misses;
+  
+  printf("\nSpeculative reads: %u hits, %u misses", hits, misses);
+  if( reads != 0 )
+    {
+      uint32_t permille = (uint32_t)(hits * 1000ULL / reads);
+      
+      printf(", %u.%u%% hit rate", permille / 10, permille % 10);
+    }
+
+  // Start afresh for the next program
+  spec_hits = 0;
+  spec_misses = 0;
+  printf("\n");
+#else
+  printf("\nNeeds the core1 bus engine and SPECULATIVE_READ");
+#endif
+}
+
+void cli_bus_monitor(void)
+{
+  static const char *core0_names[CORE0_NUM_CLASS] = { "bytes written", "bytes read", "bus busy" };
+  static uint32_t core0_seen[CORE0_NUM_CLASS];
+
+  printf("\nCore0 RAM accesses since last 'b':");
+  for(int i=0; i<CORE0_NUM_CLASS; i++)
+    {
+      uint32_t count = core0_count[i];
+      
+      printf("\n  %-16s %10u", core0_names[i], count - core0_seen[i]);
+      core0_seen[i] = count;
+    }
+
+#if BUS_MONITOR && !PIO_BUS_ENGINE
+  static const char *names[BUS_NUM_CLASS] = { "valid", "multiple CE", "W glitch", "address change" };
+  static uint32_t seen[BUS_NUM_CLASS];
+  static uint32_t log_seen = 0;
+  uint32_t log_count = bus_log_count;
+  uint32_t first = log_seen;
+  
+  // Counts since the last time
+  printf("\nCore1 bus selects since last 'b':");
+  for(int i=0; i<BUS_NUM_CLASS; i++)
+    {
+      uint32_t count = bus_count[i];
+      
+      printf("\n  %-16s %10u", names[i], count - seen[i]);
+      seen[i] = count;
+    }
+
+  if( log_count - first > BUS_LOG_SIZE )
+    {
+      printf("\n%u events lost", log_count - first - BUS_LOG_SIZE);
+      first = log_count - BUS_LOG_SIZE;
+    }
+
+  for(uint32_t i=first; i!=log_count; i++)
+    {
+      volatile BUS_EVENT *e = &bus_log[i % BUS_LOG_SIZE];
+      uint32_t f = e->first;
+      uint32_t l = e->last;
+      
+      printf("\n  %-16s CE:%02X A:%03X->%03X W:%d->%d",
+	     names[e->cls],
+	     (f >> CE0_PIN) & CE_MASK,
+	     BUS_CANONICAL_ADDR((f >> A0_PIN) & ADDRESS_MASK),
+	     BUS_CANONICAL_ADDR((l >> A0_PIN) & ADDRESS_MASK),
+	     (f >> W_PIN) & 1,
+	     (l >> W_PIN) & 1);
+    }
+
+  log_seen = log_count;
+  printf("\n");
+#else
+  printf("\nBus selects need the core1 bus engine and BUS_MONITOR\n");
+#endif
+}
+
+void cli_write_byte(void)
+{
+  printf("\nWriting %02X to %02X...", parameter, address);
+
+  if( !bus_pause() )
+    {
+      printf("\nBus busy, not written");
+      core0_count[CORE0_BUSY]++;
+      return;
+    }
+  BYTE_TO_ROM_DATA(address, parameter);
+  bus_resume();
+  core0_count[CORE0_WRITE]++;
+  mark_all_dirty();
+}
+
+void cli_write_byte_16(void)
+{
+  for( int i=0; i<16; i++)
+    {
+      printf("\nWriting %02X to %02X...", parameter+i, address+i);
+      
+      if( !bus_pause() )
+	{
+	  printf("\nBus busy, not written");
+	  core0_count[CORE0_BUSY]++;
+	  break;
+	}
+      BYTE_TO_ROM_DATA(address+i, parameter+i);
+      bus_resume();
+      core0_count[CORE0_WRITE]++;
+    }
+  mark_all_dirty();
+}
+
+void cli_save_ram(void)
+{
+  save_ram(parameter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Checksums
+//
+// CRC32s of images, slots and transfers, the same values crc32_of() in
+// common/crc32.h gives on the host. With DMA_CHECKSUM a DMA channel
+// streams the bytes into a dummy word and the sniffer does the sums, so
+// core0 is free between checksum_start() and checksum_end(). The
+// sniffer's CRC-32 with bit reversed data, its output reversed and
+// inverted and a seed of all ones is the reflected CRC zlib uses.
+//
+// Transfers are a byte at a time, so any alignment or length will do.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define SNIFF_CALC_CRC32R  0x1
+
+#if DMA_CHECKSUM
+int checksum_chan;
+dma_channel_config checksum_config;
+uint32_t checksum_sink;
+#else
+uint32_t checksum_result;
+#endif
+
+void checksum_init(void)
+{
+#if DMA_CHECKSUM
+  checksum_chan = dma_claim_unused_channel(true);
+
+  checksum_config = dma_channel_get_default_config(checksum_chan);
+  channel_config_set_transfer_data_size(&checksum_config, DMA_SIZE_8);
+  channel_config_set_read_increment(&checksum_config, true);
+  channel_config_set_write_increment(&checksum_config, false);
+  channel_config_set_sniff_enable(&checksum_config, true);
+#endif
+}
+
+// Start a CRC of len bytes, one at a time
+void checksum_start(const void *data, int len)
+{
+#if DMA_CHECKSUM
+  dma_channel_wait_for_finish_blocking(checksum_chan);
+
+  dma_sniffer_enable(checksum_chan, SNIFF_CALC_CRC32R, true);
+  dma_sniffer_set_output_reverse_enabled(true);
+  dma_sniffer_set_output_invert_enabled(true);
+  dma_hw->sniff_data = 0xFFFFFFFF;
+
+  if( len > 0 )
+    {
+      dma_channel_configure(checksum_chan, &checksum_config, &checksum_sink, data, len, true);
+    }
+#else
+  checksum_result = crc32_of(data, len);
+#endif
+}
+
+uint32_t checksum_end(void)
+{
+#if DMA_CHECKSUM
+  dma_channel_wait_for_finish_blocking(checksum_chan);
+  return(dma_hw->sniff_data);
+#else
+  return(checksum_result);
+#endif
+}
+
+uint32_t checksum(const void *data, int len)
+{
+  checksum_start(data, len);
+  return(checksum_end());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Background flash writer
+//
+// A save is queued as a job of sector erases and programs, which
+// flash_writer_step() runs one at a time from the main loop. Everything
+// the job writes is copied into flash_buf when it's queued, so the RAM
+// can carry on changing and the CLI stays live while it runs. Anything
+// that fills flash_buf or reads back what a job writes waits for it with
+// flash_wait() first. 'f' shows how the last job is getting on.
+//
+// Core1 doesn't touch flash while an op runs: PICO_COPY_TO_RAM (see
+// CMakeLists.txt) puts all the code in SRAM, and the RAM image is in SRAM
+// too. Programs are a page per step, so a power fail save waits for at
+// most a page or an erase.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define FLASH_OP_ERASE    0
+#define FLASH_OP_PROGRAM  1
+
+#define FLASH_MAX_OPS     4
+
+typedef struct
+{
+  int op;
+  uint32_t offset;              // from the start of flash
+  uint32_t length;
+  uint32_t done;
+  const uint8_t *data;          // programs only
+} FLASH_OP;
+
+#define FLASH_IDLE        0
+#define FLASH_BUSY        1
+#define FLASH_DONE        2
+#define FLASH_FAILED      3
+
+char *flash_state_names[] =
+  {
+   "Idle",
+   "Busy",
+   "Done",
+   "Failed",
+  };
+
+typedef struct
+{
+  int state;
+  char what[32];
+  int num_ops;
+  int next_op;
+  uint32_t bytes_done;
+  uint32_t bytes_total;
+  absolute_time_t start;
+  int64_t elapsed_us;
+  FPTR_OK done;                 // called when it ends, if not NULL
+  FLASH_OP ops[FLASH_MAX_OPS];
+} FLASH_JOB;
+
+FLASH_JOB flash_job;
+
+// Everything one job programs, an image and a header or trailer page
+uint8_t flash_buf[ROM_SIZE_BYTES + FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+
+void flash_job_end(void)
+{
+  flash_job.elapsed_us = absolute_time_diff_us(flash_job.start, get_absolute_time());
+
+  if( flash_job.done != NULL )
+    {
+      (*flash_job.done)(flash_job.state == FLASH_DONE);
+    }
+}
+
+// Run an erase or a page of a program
+void flash_writer_step(void)
+{
+  FLASH_OP *op;
+  uint32_t ints;
+  uint32_t n;
+
+  if( flash_job.state != FLASH_BUSY )
+    {
+      return;
+    }
+
+  op = &flash_job.ops[flash_job.next_op];
+  n = op->length - op->done;
+
+  if( (op->op == FLASH_OP_PROGRAM) && (n > FLASH_PAGE_SIZE) )
+    {
+      n = FLASH_PAGE_SIZE;
+    }
+
+  // The flash can't be read while it's being erased or programmed, and
+  // the SDK wants nothing else near it until it's done
+  ints = save_and_disable_interrupts();
+  
+  if( op->op == FLASH_OP_ERASE )
+    {
+      flash_range_erase(op->offset, op->length);
+    }
+  else
+    {
+      flash_range_program(op->offset + op->done, op->data + op->done, n);
+    }
+  
+  restore_interrupts(ints);
+
+  flash_job.bytes_done += n;
+  
+  if( (op->op == FLASH_OP_PROGRAM) && (memcmp((uint8_t *)(XIP_BASE + op->offset + op->done), op->data + op->done, n) != 0) )
+    {
+      flash_job.state = FLASH_FAILED;
+    }
+  else if( (op->done += n) == op->length )
+    {
+      if( ++flash_job.next_op == flash_job.num_ops )
+	{
+	  flash_job.state = FLASH_DONE;
+	}
+    }
+
+  if( flash_job.state != FLASH_BUSY )
+    {
+      flash_job_end();
+    }
+}
+
+int flash_busy(void)
+{
+  return(flash_job.state == FLASH_BUSY);
+}
+
+// Finish the job in hand
+void flash_wait(void)
+{
+  while( flash_busy() )
+    {
+      flash_writer_step();
+    }
+}
+
+// Wait for flash_buf then start queueing a new job
+void flash_job_start(char *what, int n)
+{
+  flash_wait();
+
+  snprintf(flash_job.what, sizeof(flash_job.what), "%s %d", what, n);
+  flash_job.state = FLASH_IDLE;
+  flash_job.num_ops = 0;
+  flash_job.next_op = 0;
+  flash_job.bytes_done = 0;
+  flash_job.bytes_total = 0;
+  flash_job.done = NULL;
+}
+
+void flash_queue(int op, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+  FLASH_OP *o = &flash_job.ops[flash_job.num_ops++];
+
+  o->op = op;
+  o->offset = offset;
+  o->data = data;
+  o->length = length;
+  o->done = 0;
+
+  flash_job.bytes_total += length;
+}
+
+void flash_job_go(void)
+{
+  flash_job.start = get_absolute_time();
+  flash_job.state = (flash_job.num_ops > 0) ? FLASH_BUSY : FLASH_DONE;
+
+  if( flash_job.state == FLASH_DONE )
+    {
+      flash_job_end();
+    }
+}
+
+void cli_flash_status(void)
+{
+  printf("\n%s: %s", flash_job.what[0] ? flash_job.what : "No job", flash_state_names[flash_job.state]);
+
+  if( flash_job.num_ops > 0 )
+    {
+      printf("\n  %d of %d ops, %u of %u bytes", flash_job.next_op, flash_job.num_ops, flash_job.bytes_done, flash_job.bytes_total);
+    }
+
+  if( (flash_job.state == FLASH_DONE) || (flash_job.state == FLASH_FAILED) )
+    {
+      printf("\n  %lld ms", flash_job.elapsed_us / 1000);
+    }
+
+  store_status();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Snapshot store
+//
+// The store is a circular log of records. They are appended at the head
+// and reclaimed a sector at a time from the tail, so every sector gets
+// erased in turn however the slots are used. A record is a header page
+// followed by slot pages:
+//
+//   full      the whole image, compressed or as its extents if that
+//             saves a page
+//   delta     the pages core1 has written since the last save to the
+//             slot, on top of the full record numbered base_seq
+//   erased    no pages, the slot is empty from here on
+//
+// Records never cross a sector boundary. Their pages are written before
+// the header, so a save that is cut short leaves nothing that looks like
+// a record.
+//
+// store_scan() builds store_index[] at boot. For each slot it holds the
+// newest full record and the deltas on top of it. Loading a slot reads
+// those records directly, and saving appends one record. Slots are
+// numbers, not places in flash.
+//
+// The index is the slot directory. Each header carries the slot's
+// STORE_META as of that record, with the CRC32 of the whole image, so
+// listing a slot reads one header and nothing in flash is rewritten in
+// place. At boot every slot is read back and checked against its CRC,
+// and one that fails is marked bad and won't load.
+//
+// Before each save the tail sector is reclaimed until STORE_MIN_FREE
+// sectors are free. Slots with live records in the tail are rewritten at
+// the head as full records, then the sector is erased. After
+// STORE_MAX_DELTAS deltas a slot gets a full save, which bounds the live
+// records.
+//
+// All writes go through the flash writer. The index and the head move as
+// jobs are queued.
+//
+// Each 512 byte chip is reversed between the bus and slot formats, so bus
+// image page p is slot page p ^ 1.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define STORE_MAGIC        0x52534658      // "XFSR"
+#define STORE_VERSION      2           // 1 had no STORE_META
+
+#define STORE_FULL         0
+#define STORE_DELTA        1
+#define STORE_ERASED       2
+
+// Encodings. Raw is what erased flash holds, so records from before there
+// were encodings are raw.
+#define STORE_SNAP         0x00        // snapshot_codec.h, full records only
+#define STORE_SPARSE       0x01        // likewise
+#define STORE_RAW          0xFF
+
+// A cleared RAM in slot format
+#define STORE_BACKGROUND   (RAM_CLEARED ^ 0xFF)
+
+#define STORE_NUM_SLOTS    64
+#define STORE_MAX_DELTAS   2
+#define STORE_MIN_FREE     10
+
+#define STORE_SECTOR_PAGES (FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE)
+#define STORE_SECTORS      (FLASH_STORE_SIZE / FLASH_SECTOR_SIZE)
+#define STORE_NO_PAGE      0xFFFF
+
+// Even with every live record alone in its sector the reserve is free
+#if (STORE_NUM_SLOTS * (1 + STORE_MAX_DELTAS) + STORE_MIN_FREE) > STORE_SECTORS
+#error Snapshot store too small for its slots
+#endif
+
+// Reclaiming a sector can rewrite a slot for every two pages in it, each
+// to a sector of its own
+#if STORE_MIN_FREE <= (STORE_SECTOR_PAGES / 2)
+#error Snapshot store reserve too small
+#endif
+
+#define SLOT_NAME_LEN      16
+
+typedef struct
+{
+  uint32_t crc;                 // of the slot format image, with this record
+  uint32_t saves;               // to the slot
+  uint32_t time;                // of the save, clock_seconds()
+  uint16_t used;                // bytes that aren't cleared
+  char     name[SLOT_NAME_LEN]; // not terminated when full
+  uint32_t save_seq;            // of the save, kept when rewritten. All
+                                // ones in the first version 2 records.
+} STORE_META;
+
+typedef struct
+{
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  type;
+  uint16_t slot;
+  uint32_t seq;
+  uint32_t base_seq;    // deltas, the full record they apply to
+  uint8_t  mask;        // slot pages that follow, lowest first
+  uint8_t  pages;
+  uint8_t  encoding;
+  uint16_t length;      // encoded bytes in the pages
+  STORE_META meta;      // all ones in erased records
+} STORE_RECORD;
+
+typedef struct
+{
+  uint32_t seq;                         // of the full record, 0 if empty
+  uint16_t full;                        // page of the full record
+  uint8_t  num_deltas;
+  uint16_t delta[STORE_MAX_DELTAS];     // oldest first
+  uint8_t  bad;                         // failed its CRC at boot
+} STORE_INDEX;
+
+STORE_INDEX store_index[STORE_NUM_SLOTS];
+
+uint32_t flash_seq = 0;         // last sequence number used
+
+int store_sector = 0;           // head sector
+int store_offset = 0;           // next free page in it
+int store_tail = 0;             // oldest sector in use
+uint32_t store_reclaims = 0;
+
+// Where the RAM came from, so a save back to it can be incremental
+int ram_slot = -1;
+uint32_t ram_base_seq = 0;
+
+#define SAVE_DELTA         1
+#define SAVE_FULL          2
+
+// What a power fail save builds on: the CRC of the slot image the RAM
+// was last loaded from or saved as, and the save in hand. Its pages are
+// off bus_dirty but not yet in flash.
+uint32_t ram_crc = 0;
+volatile int save_in_hand = 0;          // SAVE_DELTA or SAVE_FULL
+volatile uint8_t saving_pages = 0;      // bus pages
+uint32_t saving_crc = 0;
+
+// Name for the next save, from 'N'
+char save_name[SLOT_NAME_LEN+1] = "";
+
+// Unix time at boot, once 'c' has set the clock
+uint32_t clock_base = 0;
+
+uint32_t clock_seconds(void)
+{
+  return(clock_base + to_ms_since_boot(get_absolute_time()) / 1000);
+}
+
+STORE_RECORD *store_record(int page)
+{
+  return((STORE_RECORD *)(flash_store_contents + page*FLASH_PAGE_SIZE));
+}
+
+int store_sector_of(int page)
+{
+  return(page / STORE_SECTOR_PAGES);
+}
+
+int store_free_sectors(void)
+{
+  return(STORE_SECTORS - 1 - (store_sector - store_tail + STORE_SECTORS) % STORE_SECTORS);
+}
+
+int store_erased(int page, int pages)
+{
+  uint32_t *p = (uint32_t *)store_record(page);
+
+  for(int i=0; i<pages*FLASH_PAGE_SIZE/4; i++)
+    {
+      if( p[i] != 0xFFFFFFFF )
+	{
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+int slot_valid(int n)
+{
+  if( (n < 0) || (n >= STORE_NUM_SLOTS) )
+    {
+      printf("\nSlots are 0 to %d\n", STORE_NUM_SLOTS-1);
+      return(0);
+    }
+  return(1);
+}
+
+// A header that fits in what is left of its sector
+int store_walkable(int page)
+{
+  STORE_RECORD *r = store_record(page);
+
+  return( (r->magic == STORE_MAGIC) && ((page % STORE_SECTOR_PAGES) + 1 + r->pages <= STORE_SECTOR_PAGES) );
+}
+
+// First record of a sector and the one after a record, -1 at the end
+int store_first(int sector)
+{
+  int page = sector * STORE_SECTOR_PAGES;
+
+  return( store_walkable(page) ? page : -1 );
+}
+
+int store_next(int page)
+{
+  int next = page + 1 + store_record(page)->pages;
+
+  if( (store_sector_of(next) != store_sector_of(page)) || !store_walkable(next) )
+    {
+      return(-1);
+    }
+  return(next);
+}
+
+// Records this firmware can read
+int store_usable(STORE_RECORD *r)
+{
+  return( (r->version >= 1) && (r->version <= STORE_VERSION) && (r->slot < STORE_NUM_SLOTS) );
+}
+
+int store_has_meta(STORE_RECORD *r)
+{
+  return(r->version >= 2);
+}
+
+// Build the index and find the head and tail
+void store_scan(void)
+{
+  uint8_t used[STORE_SECTORS];
+  int head_end = 0;
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      store_index[n].seq = 0;
+      store_index[n].full = STORE_NO_PAGE;
+      store_index[n].num_deltas = 0;
+      store_index[n].bad = 0;
+    }
+
+  // Newest full or erased record for each slot, and the newest of all
+  for(int sector=0; sector<STORE_SECTORS; sector++)
+    {
+      used[sector] = 0;
+      
+      for(int p=store_first(sector); p>=0; p=store_next(p))
+	{
+	  STORE_RECORD *r = store_record(p);
+	  STORE_INDEX *x = &store_index[r->slot];
+
+	  used[sector] = 1;
+	  
+	  if( r->seq > flash_seq )
+	    {
+	      flash_seq = r->seq;
+	      store_sector = sector;
+	      head_end = p + 1 + r->pages;
+	    }
+
+	  if( store_usable(r) && (r->type != STORE_DELTA) && (r->seq > x->seq) )
+	    {
+	      x->seq = r->seq;
+	      x->full = (r->type == STORE_FULL) ? p : STORE_NO_PAGE;
+	    }
+	}
+    }
+
+  // Deltas on top of each full record, in order
+  for(int sector=0; sector<STORE_SECTORS; sector++)
+    {
+      for(int p=store_first(sector); p>=0; p=store_next(p))
+	{
+	  STORE_RECORD *r = store_record(p);
+	  STORE_INDEX *x = &store_index[r->slot];
+	  int i;
+	  
+	  if( !store_usable(r) || (r->type != STORE_DELTA) || (x->full == STORE_NO_PAGE) || (r->base_seq != x->seq) || (x->num_deltas == STORE_MAX_DELTAS) )
+	    {
+	      continue;
+	    }
+
+	  for(i = x->num_deltas++; (i > 0) && (store_record(x->delta[i-1])->seq > r->seq); i--)
+	    {
+	      x->delta[i] = x->delta[i-1];
+	    }
+	  x->delta[i] = p;
+	}
+    }
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      if( store_index[n].full == STORE_NO_PAGE )
+	{
+	  store_index[n].seq = 0;
+	}
+    }
+
+  // Anything after the last record, from a save cut short or an older
+  // layout, means the head sector can't be added to
+  store_offset = (flash_seq == 0) ? 0 : (head_end % STORE_SECTOR_PAGES);
+  if( (flash_seq != 0) && (store_offset == 0) )
+    {
+      store_offset = STORE_SECTOR_PAGES;
+    }
+  
+  if( !store_erased(store_sector*STORE_SECTOR_PAGES + store_offset, STORE_SECTOR_PAGES - store_offset) )
+    {
+      store_offset = STORE_SECTOR_PAGES;
+    }
+
+  // Oldest sector in use follows the free ones after the head
+  store_tail = store_sector;
+  for(int i=1; i<STORE_SECTORS; i++)
+    {
+      int sector = (store_sector + i) % STORE_SECTORS;
+
+      if( used[sector] )
+	{
+	  store_tail = sector;
+	  break;
+	}
+    }
+}
+
+// Copy the pages of a record over an image converted with flags, returns
+// 0 if it won't decode
+int store_apply(int page, uint8_t *dest, int flags)
+{
+  STORE_RECORD *r = store_record(page);
+  uint8_t *data = (uint8_t *)r + FLASH_PAGE_SIZE;
+
+  if( r->encoding == STORE_SNAP )
+    {
+      return( snap_decode(dest, ROM_SIZE_BYTES, data, r->length, flags) == ROM_SIZE_BYTES );
+    }
+
+  if( r->encoding == STORE_SPARSE )
+    {
+      return( snap_sparse_decode(dest, ROM_SIZE_BYTES, data, r->length, flags) == ROM_SIZE_BYTES );
+    }
+  
+  for(int sp=0; sp<IMAGE_PAGES; sp++)
+    {
+      if( r->mask & (1 << sp) )
+	{
+	  snap_put(dest, sp*FLASH_PAGE_SIZE, data, FLASH_PAGE_SIZE, flags);
+	  data += FLASH_PAGE_SIZE;
+	}
+    }
+  return(1);
+}
+
+// Read a slot into an image converted from slot format with flags, so
+// IMAGE_SLOT gives a bus image. Returns the sequence number of its full
+// record, 0 if it's empty (and so erased flash) or won't decode.
+uint32_t slot_read(int n, uint8_t *dest, int flags)
+{
+  STORE_INDEX *x = &store_index[n];
+  int ok;
+
+  // The index runs ahead of the flash writer
+  flash_wait();
+
+  if( x->seq == 0 )
+    {
+      snap_fill(dest, 0, 0xFF, ROM_SIZE_BYTES, flags);
+      return(0);
+    }
+  
+  ok = store_apply(x->full, dest, flags);
+  for(int i=0; i<x->num_deltas; i++)
+    {
+      ok &= store_apply(x->delta[i], dest, flags);
+    }
+
+  if( !ok )
+    {
+      printf("\nSlot %d is corrupt", n);
+      x->bad = 1;
+      return(0);
+    }
+  
+  return(x->seq);
+}
+
+// The newest record of a slot, the one with its current metadata. NULL
+// if it's empty.
+STORE_RECORD *slot_newest(int n)
+{
+  STORE_INDEX *x = &store_index[n];
+
+  if( x->seq == 0 )
+    {
+      return(NULL);
+    }
+  return(store_record( (x->num_deltas > 0) ? x->delta[x->num_deltas-1] : x->full ));
+}
+
+int image_used(const uint8_t *image)
+{
+  int used = 0;
+
+  for(int i=0; i<ROM_SIZE_BYTES; i++)
+    {
+      used += (image[i] != STORE_BACKGROUND);
+    }
+  return(used);
+}
+
+// Metadata for a new record of slot n holding a slot format image. A
+// save counts, is timed and takes the name from 'N' if there is one.
+// Rewriting a slot keeps what it had, CRC and all, so a bad slot stays
+// bad.
+void store_meta(int n, const uint8_t *image, int save, STORE_META *m)
+{
+  STORE_RECORD *last = slot_newest(n);
+  int had = (last != NULL) && store_has_meta(last);
+
+  if( had )
+    {
+      memcpy(m, &last->meta, sizeof(*m));
+    }
+  else
+    {
+      memset(m, 0, sizeof(*m));
+    }
+
+  if( save || !had )
+    {
+      // Count while the sniffer works
+      checksum_start(image, ROM_SIZE_BYTES);
+      m->used = image_used(image);
+      m->crc = checksum_end();
+    }
+  
+  if( save )
+    {
+      m->saves++;
+      m->time = clock_seconds();
+      m->save_seq = flash_seq + 1;
+
+      if( save_name[0] != '\0' )
+	{
+	  strncpy(m->name, save_name, SLOT_NAME_LEN);
+	}
+    }
+}
+
+// Read a slot into image_buf in slot format and check it against its
+// CRC. Returns the sequence number of its full record, 0 if it's empty
+// or bad.
+uint32_t slot_read_checked(int n)
+{
+  uint32_t seq = slot_read(n, image_buf, 0);
+  STORE_RECORD *r = slot_newest(n);
+
+  if( (seq != 0) && store_has_meta(r) && (checksum(image_buf, ROM_SIZE_BYTES) != r->meta.crc) )
+    {
+      printf("\nSlot %d fails its CRC", n);
+      store_index[n].bad = 1;
+      return(0);
+    }
+  return(seq);
+}
+
+// The slot saved to last, -1 if there isn't one
+int store_last_saved(void)
+{
+  uint32_t best = 0;
+  int last = -1;
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      STORE_RECORD *r = slot_newest(n);
+
+      if( (r != NULL) && store_has_meta(r) && (r->meta.save_seq != 0xFFFFFFFF) && (r->meta.save_seq > best) )
+	{
+	  best = r->meta.save_seq;
+	  last = n;
+	}
+    }
+  return(last);
+}
+
+// Read every slot back and check it
+void store_verify(void)
+{
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      if( store_index[n].seq != 0 )
+	{
+	  slot_read_checked(n);
+	}
+    }
+}
+
+// Queue a record at the head and index it. The pages are already in
+// flash_buf after the header page. meta is NULL for erased records.
+// Returns its sequence number, 0 if the store is full.
+uint32_t store_append(int type, int slot, uint32_t base_seq, uint8_t mask, int pages, int encoding, int length, const STORE_META *meta)
+{
+  STORE_RECORD *r = (STORE_RECORD *)flash_buf;
+  STORE_INDEX *x = &store_index[slot];
+  int page;
+
+  if( store_offset + 1 + pages > STORE_SECTOR_PAGES )
+    {
+      if( store_free_sectors() == 0 )
+	{
+	  printf("\nSnapshot store full\n");
+	  return(0);
+	}
+      
+      store_sector = (store_sector + 1) % STORE_SECTORS;
+      store_offset = 0;
+
+      // Left dirty by an erase cut short or an older layout
+      if( !store_erased(store_sector * STORE_SECTOR_PAGES, STORE_SECTOR_PAGES) )
+	{
+	  flash_queue(FLASH_OP_ERASE, FLASH_STORE_OFFSET + store_sector*FLASH_SECTOR_SIZE, NULL, FLASH_SECTOR_SIZE);
+	}
+    }
+
+  page = store_sector * STORE_SECTOR_PAGES + store_offset;
+  store_offset += 1 + pages;
+
+  memset(r, 0xFF, FLASH_PAGE_SIZE);
+  r->magic = STORE_MAGIC;
+  r->version = STORE_VERSION;
+  r->type = type;
+  r->slot = slot;
+  r->seq = ++flash_seq;
+  r->base_seq = base_seq;
+  r->mask = mask;
+  r->pages = pages;
+  r->encoding = encoding;
+  r->length = length;
+
+  if( meta != NULL )
+    {
+      memcpy(&r->meta, meta, sizeof(*meta));
+    }
+
+  // Pages first, the header makes the record live
+  if( pages > 0 )
+    {
+      flash_queue(FLASH_OP_PROGRAM, FLASH_STORE_OFFSET + (page+1)*FLASH_PAGE_SIZE, flash_buf + FLASH_PAGE_SIZE, pages*FLASH_PAGE_SIZE);
+    }
+  flash_queue(FLASH_OP_PROGRAM, FLASH_STORE_OFFSET + page*FLASH_PAGE_SIZE, flash_buf, FLASH_PAGE_SIZE);
+
+  switch(type)
+    {
+    case STORE_FULL:
+      x->seq = r->seq;
+      x->full = page;
+      x->num_deltas = 0;
+      break;
+
+    case STORE_DELTA:
+      x->delta[x->num_deltas++] = page;
+      break;
+
+    case STORE_ERASED:
+      x->seq = 0;
+      x->full = STORE_NO_PAGE;
+      x->num_deltas = 0;
+      x->bad = 0;
+      break;
+    }
+  
+  return(r->seq);
+}
+
+int pages_for(int len)
+{
+  return( (len + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE );
+}
+
+// Queue a full record of a slot format image, as the extents that aren't
+// cleared or compressed, whichever takes fewer pages. The extents are
+// quicker both ways, so they win a tie and a program that fits in a page
+// that way doesn't get compressed at all.
+uint32_t store_append_full(int slot, const uint8_t *image, const STORE_META *meta)
+{
+  uint8_t *data = flash_buf + FLASH_PAGE_SIZE;
+  int max = ROM_SIZE_BYTES - FLASH_PAGE_SIZE;
+  int sparse = snap_sparse_encode(snap_buf, max, image, ROM_SIZE_BYTES, STORE_BACKGROUND);
+  int len;
+
+  if( (sparse < 0) || (pages_for(sparse) > 1) )
+    {
+      len = snap_encode(data, max, image, ROM_SIZE_BYTES, &snap_state);
+
+      if( (len >= 0) && ((sparse < 0) || (pages_for(len) < pages_for(sparse))) )
+	{
+	  return(store_append(STORE_FULL, slot, 0, (1 << IMAGE_PAGES) - 1, pages_for(len), STORE_SNAP, len, meta));
+	}
+    }
+
+  if( sparse >= 0 )
+    {
+      memcpy(data, snap_buf, sparse);
+      return(store_append(STORE_FULL, slot, 0, (1 << IMAGE_PAGES) - 1, pages_for(sparse), STORE_SPARSE, sparse, meta));
+    }
+  
+  memcpy(data, image, ROM_SIZE_BYTES);
+  return(store_append(STORE_FULL, slot, 0, (1 << IMAGE_PAGES) - 1, IMAGE_PAGES, STORE_RAW, ROM_SIZE_BYTES, meta));
+}
+
+// Does a slot have live records in a sector
+int store_slot_in(int n, int sector)
+{
+  STORE_INDEX *x = &store_index[n];
+
+  if( x->seq == 0 )
+    {
+      return(0);
+    }
+  
+  if( store_sector_of(x->full) == sector )
+    {
+      return(1);
+    }
+
+  for(int i=0; i<x->num_deltas; i++)
+    {
+      if( store_sector_of(x->delta[i]) == sector )
+	{
+	  return(1);
+	}
+    }
+  return(0);
+}
+
+// Rewrite the live records in the tail sector at the head, then erase it.
+// Each slot has to be written before flash_buf can take the next, so
+// this waits for each job. If a slot can't be rewritten the tail is left
+// alone, it still has the only good copy. Returns 0 if so.
+int store_reclaim(void)
+{
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      uint32_t old_seq = store_index[n].seq;
+      uint32_t seq;
+      STORE_META meta;
+      
+      if( !store_slot_in(n, store_tail) )
+	{
+	  continue;
+	}
+
+      flash_job_start("Reclaim slot", n);
+      slot_read(n, image_buf, 0);
+      store_meta(n, image_buf, 0, &meta);
+      seq = store_append_full(n, image_buf, &meta);
+      flash_job_go();
+      flash_wait();
+
+      if( (seq == 0) || (flash_job.state != FLASH_DONE) )
+	{
+	  printf("\nCan't reclaim sector %d, slot %d not rewritten\n", store_tail, n);
+	  return(0);
+	}
+
+      // Same data, so the RAM can still be saved incrementally
+      if( (n == ram_slot) && (ram_base_seq == old_seq) )
+	{
+	  ram_base_seq = seq;
+	}
+    }
+
+  flash_job_start("Erase sector", store_tail);
+  flash_queue(FLASH_OP_ERASE, FLASH_STORE_OFFSET + store_tail*FLASH_SECTOR_SIZE, NULL, FLASH_SECTOR_SIZE);
+  flash_job_go();
+  
+  store_tail = (store_tail + 1) % STORE_SECTORS;
+  store_reclaims++;
+  return(1);
+}
+
+// Returns 0 if the store can't be given STORE_MIN_FREE sectors
+int store_make_room(void)
+{
+  while( store_free_sectors() < STORE_MIN_FREE )
+    {
+      if( !store_reclaim() )
+	{
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+void store_status(void)
+{
+  int live = 0;
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      live += (store_index[n].seq != 0);
+    }
+  
+  printf("\nStore: %d of %d slots used, head sector %d page %d, tail sector %d, %d sectors free",
+	 live, STORE_NUM_SLOTS, store_sector, store_offset, store_tail, store_free_sectors());
+  printf("\n  Sequence %u, %u sectors reclaimed\n", flash_seq, store_reclaims);
+}
+
+// The RAM no longer matches what was loaded, the next save is a full one
+void mark_all_dirty(void)
+{
+  for(int p=0; p<IMAGE_PAGES; p++)
+    {
+      bus_dirty[p] = 1;
+    }
+}
+
+int any_dirty(void)
+{
+#if PIO_BUS_ENGINE
+  // DMA writes can't be tracked
+  return(1);
+#else
+  for(int p=0; p<IMAGE_PAGES; p++)
+    {
+      if( bus_dirty[p] )
+	{
+	  return(1);
+	}
+    }
+  return(0);
+#endif
+}
+
+// Replace the RAM with a slot, 0 if it's bad or the bus is busy
+int load_slot(int n)
+{
+  // Checked before the RAM is touched
+  uint32_t seq = slot_read_checked(n);
+
+  if( store_index[n].bad )
+    {
+      return(0);
+    }
+
+  if( !image_import(image_buf, IMAGE_SLOT) )
+    {
+      return(0);
+    }
+  ram_crc = checksum(image_buf, ROM_SIZE_BYTES);
+
+  // Nothing to save until core1 sees a write
+  for(int p=0; p<IMAGE_PAGES; p++)
+    {
+      bus_dirty[p] = 0;
+    }
+  ram_base_seq = seq;
+  ram_slot = (seq != 0) ? n : -1;
+  return(1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Power fail save
+//
+// When POWER_FAIL_PIN falls the GPIO interrupt writes the pages of the
+// RAM that aren't in flash to a sector kept erased for the purpose,
+// after the store. Nothing is erased and nothing waits on the store, so
+// the time taken is bounded: the flash op in hand when the edge comes,
+// the glitch filter, copying and checking the image, then a page
+// program for each page and the header. The banner and 'P' give the
+// figure.
+//
+// The pages are those core1 has marked since the last save, and those
+// of a save still being written. They go on the slot image the RAM was
+// loaded from or was being saved as, both recorded by CRC. With no slot
+// loaded, or the PIO engine that can't track writes, the whole image
+// goes.
+//
+// At boot a save found there goes into the RAM before anything else.
+// Once USB is up it is saved to its slot properly and the sector is
+// erased again. The same happens if the supply comes back.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#if POWER_FAIL_PIN >= 0
+
+#define POWER_FAIL_OFFSET     (FLASH_STORE_OFFSET + FLASH_STORE_SIZE)
+#define POWER_FAIL_MAGIC      0x50465846      // "FXFP"
+#define POWER_FAIL_GLITCH_US  20
+
+// Datasheet maximums for the Pico's W25Q16JV
+#define FLASH_PAGE_PROGRAM_MAX_US  3000
+#define FLASH_SECTOR_ERASE_MAX_US  400000
+
+#if (POWER_FAIL_OFFSET + FLASH_SECTOR_SIZE) > PICO_FLASH_SIZE_BYTES
+#error No room for the power fail sector
+#endif
+
+typedef struct
+{
+  uint32_t magic;
+  uint16_t slot;
+  uint8_t  mask;        // slot pages that follow, lowest first
+  uint8_t  pages;
+  uint32_t base_crc;    // of the slot images the pages go on
+  uint32_t alt_crc;
+  uint32_t crc;         // of the image with them
+  uint32_t write_us;    // from the edge to the pages being in flash
+} POWER_FAIL_RECORD;
+
+#define PF_OFF     0    // until the sector is erased
+#define PF_ARMED   1
+#define PF_SAVED   2
+
+char *pf_state_names[] =
+  {
+   "Off",
+   "Armed",
+   "Saved",
+  };
+
+volatile int pf_state = PF_OFF;
+volatile uint32_t pf_glitches = 0;
+uint32_t pf_prep_us = 0;                // measured at boot
+int pf_restored = 0;
+
+// Header page and image, built by the interrupt
+uint8_t pf_buf[FLASH_PAGE_SIZE + ROM_SIZE_BYTES] __attribute__((aligned(4)));
+
+POWER_FAIL_RECORD *pf_record(void)
+{
+  return((POWER_FAIL_RECORD *)(XIP_BASE + POWER_FAIL_OFFSET));
+}
+
+int pf_erased(void)
+{
+  uint32_t *p = (uint32_t *)pf_record();
+
+  for(int i=0; i<FLASH_SECTOR_SIZE/4; i++)
+    {
+      if( p[i] != 0xFFFFFFFF )
+	{
+	  return(0);
+	}
+    }
+  return(1);
+}
+
+// Slot pages a save now would write. A full save in hand may be to
+// another slot, so it's everything until that lands.
+uint8_t pf_mask(void)
+{
+  uint8_t mask = 0;
+
+#if !PIO_BUS_ENGINE
+  if( (ram_slot >= 0) && (save_in_hand != SAVE_FULL) )
+    {
+      for(int p=0; p<IMAGE_PAGES; p++)
+	{
+	  if( bus_dirty[p] || (saving_pages & (1 << p)) )
+	    {
+	      mask |= 1 << (p ^ 1);
+	    }
+	}
+      return(mask);
+    }
+#endif
+
+  return((1 << IMAGE_PAGES) - 1);
+}
+
+// Longest the supply has to hold up for a save of some pages, with an
+// erase or a page program in hand when the edge comes
+uint32_t pf_hold_up_us(int pages, int erasing)
+{
+  return( (erasing ? FLASH_SECTOR_ERASE_MAX_US : FLASH_PAGE_PROGRAM_MAX_US)
+	  + POWER_FAIL_GLITCH_US + pf_prep_us + (1 + pages) * FLASH_PAGE_PROGRAM_MAX_US );
+}
+
+// Copy the RAM into pf_buf as a slot image and take its CRC. Not with
+// the sniffer, core0 may be part way through a checksum of its own.
+void pf_prepare(void)
+{
+  POWER_FAIL_RECORD *r = (POWER_FAIL_RECORD *)pf_buf;
+
+  image_export(pf_buf + FLASH_PAGE_SIZE, IMAGE_SLOT);
+  r->crc = crc32_of(pf_buf + FLASH_PAGE_SIZE, ROM_SIZE_BYTES);
+}
+
+void pf_program(int page, const uint8_t *data)
+{
+  flash_range_program(POWER_FAIL_OFFSET + page*FLASH_PAGE_SIZE, data, FLASH_PAGE_SIZE);
+}
+
+void power_fail_irq(uint gpio, uint32_t events)
+{
+  uint32_t start = time_us_32();
+  POWER_FAIL_RECORD *r = (POWER_FAIL_RECORD *)pf_buf;
+  uint32_t ints;
+  int page = 1;
+
+  if( (gpio != POWER_FAIL_PIN) || (pf_state != PF_ARMED) )
+    {
+      return;
+    }
+
+  // A dip that has gone again isn't a power fail
+  busy_wait_us_32(POWER_FAIL_GLITCH_US);
+  if( gpio_get(POWER_FAIL_PIN) )
+    {
+      pf_glitches++;
+      return;
+    }
+
+  memset(r, 0xFF, FLASH_PAGE_SIZE);
+  r->magic = POWER_FAIL_MAGIC;
+  r->slot = (ram_slot >= 0) ? ram_slot : POWER_FAIL_SLOT;
+  r->mask = pf_mask();
+  r->pages = __builtin_popcount(r->mask);
+  r->base_crc = ram_crc;
+  r->alt_crc = save_in_hand ? saving_crc : ram_crc;
+  pf_prepare();
+
+  // Nothing else may touch the flash while it's being programmed
+  ints = save_and_disable_interrupts();
+
+  for(int sp=0; sp<IMAGE_PAGES; sp++)
+    {
+      if( r->mask & (1 << sp) )
+	{
+	  pf_program(page++, pf_buf + FLASH_PAGE_SIZE + sp*FLASH_PAGE_SIZE);
+	}
+    }
+
+  // The header makes the save live
+  r->write_us = time_us_32() - start;
+  pf_program(0, pf_buf);
+
+  restore_interrupts(ints);
+
+  pf_state = PF_SAVED;
+}
+
+// Put a save left by a power fail into the RAM, before the bus is
+// served. Returns its slot, -1 if there isn't a good one.
+int power_fail_restore(void)
+{
+  POWER_FAIL_RECORD *r = pf_record();
+  uint8_t *data = (uint8_t *)r + FLASH_PAGE_SIZE;
+  STORE_INDEX *x;
+  uint32_t crc;
+
+  if( (r->magic != POWER_FAIL_MAGIC) || (r->slot >= STORE_NUM_SLOTS) || (r->pages != __builtin_popcount(r->mask)) )
+    {
+      return(-1);
+    }
+  x = &store_index[r->slot];
+
+  slot_read_checked(r->slot);
+  crc = checksum(image_buf, ROM_SIZE_BYTES);
+
+  // Some pages only go on the image they were taken against
+  if( (r->mask != (1 << IMAGE_PAGES) - 1) && (x->bad || ((crc != r->base_crc) && (crc != r->alt_crc))) )
+    {
+      return(-1);
+    }
+
+  for(int sp=0; sp<IMAGE_PAGES; sp++)
+    {
+      if( r->mask & (1 << sp) )
+	{
+	  memcpy(image_buf + sp*FLASH_PAGE_SIZE, data, FLASH_PAGE_SIZE);
+	  data += FLASH_PAGE_SIZE;
+	}
+    }
+
+  if( checksum(image_buf, ROM_SIZE_BYTES) != r->crc )
+    {
+      return(-1);
+    }
+
+  if( !image_import(image_buf, IMAGE_SLOT) )
+    {
+      return(-1);
+    }
+
+  // power_fail_init() saves the pages, as a delta if it can
+  for(int p=0; p<IMAGE_PAGES; p++)
+    {
+      bus_dirty[p] = (r->mask >> (p ^ 1)) & 1;
+    }
+  ram_crc = crc;
+  ram_base_seq = x->seq;
+  ram_slot = ((x->seq != 0) && !x->bad) ? r->slot : -1;
+
+  pf_restored = 1;
+  return(r->slot);
+}
+
+// Erase the sector if it needs it, power_fail_poll() arms once it's done
+void pf_erase(void)
+{
+  pf_state = PF_OFF;
+
+  if( !pf_erased() )
+    {
+      flash_job_start("Erase power fail sector", POWER_FAIL_OFFSET / FLASH_SECTOR_SIZE);
+      flash_queue(FLASH_OP_ERASE, POWER_FAIL_OFFSET, NULL, FLASH_SECTOR_SIZE);
+      flash_job_go();
+    }
+}
+
+// Once USB is up: save what power_fail_restore() found, and arm
+void power_fail_init(void)
+{
+  POWER_FAIL_RECORD *r = pf_record();
+  uint32_t start = time_us_32();
+
+  // Time what the interrupt does besides programming
+  pf_prepare();
+  pf_prep_us = time_us_32() - start;
+
+  if( pf_restored )
+    {
+      save_ram(r->slot);
+    }
+  else if( r->magic == POWER_FAIL_MAGIC )
+    {
+      printf("\nPower fail save for slot %d doesn't fit it, dropped", r->slot);
+    }
+  
+  pf_erase();
+
+  set_gpio_input(POWER_FAIL_PIN);
+  gpio_set_irq_enabled_with_callback(POWER_FAIL_PIN, GPIO_IRQ_EDGE_FALL, true, power_fail_irq);
+
+  printf("\nPower fail sense on GPIO %d, hold up %u us, %u us if erasing\n",
+	 POWER_FAIL_PIN, pf_hold_up_us(IMAGE_PAGES, 0), pf_hold_up_us(IMAGE_PAGES, 1));
+}
+
+// From the main loop
+void power_fail_poll(void)
+{
+  switch(pf_state)
+    {
+    case PF_OFF:
+      if( !flash_busy() && pf_erased() )
+	{
+	  pf_state = PF_ARMED;
+	}
+      break;
+
+    case PF_SAVED:
+      // The supply came back
+      if( gpio_get(POWER_FAIL_PIN) )
+	{
+	  printf("\nSupply back after a power fail save");
+	  save_ram(pf_record()->slot);
+	  pf_erase();
+	}
+      break;
+    }
+}
+#endif
+
+void cli_power_fail(void)
+{
+#if POWER_FAIL_PIN < 0
+  printf("\nNeeds POWER_FAIL_PIN");
+#else
+  POWER_FAIL_RECORD *r = pf_record();
+  int pages = __builtin_popcount(pf_mask());
+
+  printf("\nPower fail sense on GPIO %d: %s, supply %s, %u glitches",
+	 POWER_FAIL_PIN, pf_state_names[pf_state], gpio_get(POWER_FAIL_PIN) ? "good" : "low", pf_glitches);
+  printf("\n  %d pages to save, hold up %u us, %u us if erasing", pages, pf_hold_up_us(pages, 0), pf_hold_up_us(pages, 1));
+
+  if( r->magic == POWER_FAIL_MAGIC )
+    {
+      printf("\n  Saved slot %d, %d pages, in %u us", r->slot, r->pages, r->write_us);
+    }
+  printf("\n");
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// Fast start
+//
+// BOOT_SLOT is restored into the RAM before core1 starts serving the
+// bus, and before USB, so the calculator sees its program from its
+// first read. Serving the fill first and restoring under bus_pause()
+// would start the bus sooner, but the FX702P could set up the cleared
+// RAM meanwhile and the restore would throw its writes away under it.
+// Nothing can be printed yet, boot_report() says how it went once there
+// is a banner.
+//
+// Times are from time_us_32(), which starts when the SDK's runtime init
+// takes the timer out of reset. The boot ROM, boot2 and the copy of the
+// program to RAM come before that and aren't counted.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+int boot_slot = -1;
+int boot_loaded = 0;
+uint32_t boot_scan_us = 0;
+uint32_t boot_restore_us = 0;
+uint32_t boot_served_us = 0;            // timer at core1 start
+
+void boot_restore(void)
+{
+  uint32_t start = time_us_32();
+
+#if POWER_FAIL_PIN >= 0
+  // Newer than any slot
+  if( (boot_slot = power_fail_restore()) >= 0 )
+    {
+      boot_loaded = 1;
+      boot_restore_us = time_us_32() - start;
+      return;
+    }
+#endif
+
+#if BOOT_SLOT == BOOT_LAST_SAVED
+  boot_slot = store_last_saved();
+#else
+  boot_slot = BOOT_SLOT;
+#endif
+
+  // An empty slot leaves the fill
+  if( (boot_slot >= 0) && (boot_slot < STORE_NUM_SLOTS) && (store_index[boot_slot].seq != 0) )
+    {
+      boot_loaded = load_slot(boot_slot);
+    }
+
+  boot_restore_us = time_us_32() - start;
+}
+
+void boot_report(void)
+{
+#if EMBEDDED_IMAGE
+  printf("\nEmbedded image %s, CRC32 %08X", EMBEDDED_IMAGE_NAME, EMBEDDED_IMAGE_CRC);
+#endif
+
+#if POWER_FAIL_PIN >= 0
+  if( pf_restored )
+    {
+      printf("\nRestored the power fail save of slot %d, %d pages written in %u us", boot_slot, pf_record()->pages, pf_record()->write_us);
+    }
+  else
+#endif
+  if( boot_loaded )
+    {
+      printf("\nRestored slot %d in %u us", boot_slot, boot_restore_us);
+    }
+  else if( boot_slot >= 0 )
+    {
+      printf("\nSlot %d not restored", boot_slot);
+    }
+
+  printf("\nBus served %u us after the timer started, store scan %u us\n", boot_served_us, boot_scan_us);
+}
+
+void cli_load_ram(void)
+{
+  if( !slot_valid(parameter) )
+    {
+      return;
+    }
+  
+  if( store_index[parameter].bad )
+    {
+      printf("\nSlot %d is bad, not loaded\n", parameter);
+      return;
+    }
+  
+  printf("\nLoading program from flash slot %03d", parameter);
+
+  if( !load_slot(parameter) )
+    {
+      printf(", not loaded");
+    }
+  printf("\n");
+}
+
+// Empty a slot
+void erase_slot(int n)
+{
+  if( !store_make_room() )
+    {
+      return;
+    }
+  
+  flash_job_start("Erase slot", n);
+  store_append(STORE_ERASED, n, 0, 0, 0, STORE_RAW, 0, NULL);
+  flash_job_go();
+}
+
+void cli_erase_program_slot(void)
+{
+  if( !slot_valid(parameter) )
+    {
+      return;
+    }
+  
+  printf("\nErasing program slot %d...", parameter);
+  erase_slot(parameter);
+
+  if( parameter == ram_slot )
+    {
+      ram_slot = -1;
+    }
+  printf("\ndone.\n");
+}
+
+// Unix time once the clock is set, otherwise seconds after boot
+void format_time(char *buf, uint32_t t)
+{
+  time_t tt = t;
+  struct tm *tm = gmtime(&tt);
+
+  if( t >= 1000000000 )
+    {
+      sprintf(buf, "%04d-%02d-%02d %02d:%02d", tm->tm_year+1900, tm->tm_mon+1, tm->tm_mday, tm->tm_hour, tm->tm_min);
+    }
+  else
+    {
+      sprintf(buf, "boot+%us", t);
+    }
+}
+
+// The slot directory, from the index and the newest header of each slot
+void cli_list_slots(void)
 {
-  trace_on = 1;
-}
+  char when[24];
 
-void cli_display_trace(void)
-{
-  char flg;
-  
-  for(int i=0; i<MAX_ADDR_TRACE; i++)
+  // The index runs ahead of the flash writer
+  flash_wait();
+
+  printf("\nSlot  Name              Saves  Saved             Used  Stored  CRC");
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
     {
-      switch(flag_trace[i])
+      STORE_INDEX *x = &store_index[n];
+      STORE_RECORD *r = slot_newest(n);
+      int stored;
+
+      if( r == NULL )
 	{
-	case FLAG_WRITE:
-	  flg = 'W';
-	  break;
+	  continue;
+	}
 
-	case FLAG_READ:
-	  flg = 'R';
-	  break;
+      stored = 1 + store_record(x->full)->pages;
+      for(int i=0; i<x->num_deltas; i++)
+	{
+	  stored += 1 + store_record(x->delta[i])->pages;
+	}
 
-	default:
-	  flg = ' ';
-	  break;
+      if( !store_has_meta(r) )
+	{
+	  printf("\n%4d  %-16s  %5s  %-16s  %4s  %6d  %8s", n, "", "", "", "", stored*FLASH_PAGE_SIZE, "none");
 	}
-      
-      printf("\n%05d: %04X %01X %02X %c %c", i, addr_trace[i], ce_trace[i], data_trace[i], flg, (i==addr_trace_index)?'*':' ');
+      else
+	{
+	  format_time(when, r->meta.time);
+	  printf("\n%4d  %-16.16s  %5u  %-16s  %4u  %6d  %08X",
+		 n, r->meta.name, r->meta.saves, when, r->meta.used, stored*FLASH_PAGE_SIZE, r->meta.crc);
+	}
+
+      printf("%s%s", x->bad ? "  BAD" : "", (n == ram_slot) ? "  loaded" : "");
     }
+  printf("\n");
 }
 
-void cli_write_byte(void)
+// Name the next save, a line of up to SLOT_NAME_LEN characters. An empty
+// line keeps the slot's name.
+void cli_set_name(void)
 {
-  printf("\nWriting %02X to %02X...", parameter, address);
-
-  BYTE_TO_ROM_DATA(address, parameter);
+  printf("\nName: ");
+  read_line(save_name, sizeof(save_name));
+  printf("\n");
 }
 
-void cli_write_byte_16(void)
+// Set the clock from the parameter, as Unix time
+void cli_set_clock(void)
 {
-  for( int i=0; i<16; i++)
-    {
-      printf("\nWriting %02X to %02X...", parameter+i, address+i);
-      
-      BYTE_TO_ROM_DATA(address+i, parameter+i);
-    }
-}
+  char when[24];
 
-void cli_save_ram(void)
-{
-  save_ram(parameter);
+  clock_base = parameter - to_ms_since_boot(get_absolute_time()) / 1000;
+
+  format_time(when, clock_seconds());
+  printf("\nClock set to %s\n", when);
 }
 
-void cli_load_ram(void)
+// CRC of the RAM as the host sees it, against the software one, then
+// every slot against its own
+void cli_checksum(void)
 {
-  printf("\nLoading program from flash slot %03d", parameter);
+  uint32_t t0, t1, t2;
+  uint32_t crc, soft;
+  int checked = 0;
+  int bad = 0;
 
-  // Get packed data
-  memcpy(packed_ram, flash_slot_contents+parameter*FLASH_SLOT_SIZE, ROM_SIZE_BYTES);
+  image_export(image_buf, IMAGE_CANONICAL);
 
-  // Unpack it into emulation RAM
-  unpack_ram(packed_ram);
-  
-  printf("\n");
-}
+  t0 = time_us_32();
+  crc = checksum(image_buf, ROM_SIZE_BYTES);
+  t1 = time_us_32();
+  soft = crc32_of(image_buf, ROM_SIZE_BYTES);
+  t2 = time_us_32();
 
-// Erase a slot
-void erase_slot(int n)
-{
-  flash_range_erase(FLASH_SLOT_OFFSET+n*FLASH_SLOT_SIZE, FLASH_SLOT_SIZE);
-}
+  printf("\nRAM CRC32 %08X in %u us, software %08X in %u us%s", crc, t1-t0, soft, t2-t1, (crc != soft) ? "  MISMATCH" : "");
+  printf("\nCheck value %08X, should be %08X", checksum("123456789", 9), CRC32_CHECK);
 
-void cli_erase_program_slot(void)
-{
-  printf("\nErasing program slot %d...", parameter);
-  erase_slot(parameter);
-  printf("\ndone.\n");
+  store_verify();
+
+  for(int n=0; n<STORE_NUM_SLOTS; n++)
+    {
+      checked += (store_index[n].seq != 0);
+      bad += store_index[n].bad;
+    }
+  printf("\n%d slots checked, %d bad\n", checked, bad);
 }
 
+#if PIO_BUS_ENGINE
+// The PIO engine keeps a nibble per byte, pack and unpack the bus image
 void pack_ram_into(uint8_t *dest)
 {
   for(int i=0; i<ROM_SIZE; i+=2)
     {
-      *dest = (rom_data[i+1] & 0xF) * 16 + (rom_data[i] & 0xF);
+      *dest = RAM_NIBBLE(i+1) * 16 + RAM_NIBBLE(i);
       dest++;
     }
 }
@@ -675,32 +3374,186 @@ void unpack_ram(uint8_t *src)
 {
   for(int i=0; i<ROM_SIZE_BYTES; i++)
     {
-      rom_data[i*2+1] = ((*src) & 0xF0) >> 4;
-      rom_data[i*2+0] = ((*src) & 0x0F) >> 0;
+      SET_RAM_NIBBLE(i*2+1, ((*src) & 0xF0) >> 4);
+      SET_RAM_NIBBLE(i*2+0, ((*src) & 0x0F) >> 0);
       src++;
     }
 }
+#endif
+
+// Copy the emulation RAM out as a slot or canonical image
+void image_export(uint8_t *dest, int flags)
+{
+#if PIO_BUS_ENGINE
+  pack_ram_into(dest);
+  ram_image_convert(dest, dest, ROM_SIZE_BYTES, flags);
+#else
+  ram_image_convert(dest, (uint8_t *)rom_data, ROM_SIZE_BYTES, flags);
+#endif
+  core0_count[CORE0_READ] += ROM_SIZE_BYTES;
+}
+
+// Replace the emulation RAM with a slot or canonical image, 0 if core1
+// couldn't be stopped and the RAM is unchanged
+int image_import(const uint8_t *src, int flags)
+{
+#if PIO_BUS_ENGINE
+  ram_image_convert(image_buf, src, ROM_SIZE_BYTES, flags);
+  unpack_ram(image_buf);
+#else
+  if( !bus_pause() )
+    {
+      core0_count[CORE0_BUSY]++;
+      return(0);
+    }
+  ram_image_convert((uint8_t *)rom_data, src, ROM_SIZE_BYTES, flags);
+  bus_resume();
+#endif
+  core0_count[CORE0_WRITE] += ROM_SIZE_BYTES;
+  return(1);
+}
+
+// A save has reached flash, or hasn't
+void save_done(int ok)
+{
+  if( ok )
+    {
+      ram_crc = saving_crc;
+    }
+  else
+    {
+      for(int p=0; p<IMAGE_PAGES; p++)
+	{
+	  if( saving_pages & (1 << p) )
+	    {
+	      bus_dirty[p] = 1;
+	    }
+	}
+    }
 
+  saving_pages = 0;
+  save_in_hand = 0;
+}
 
 void save_ram(int slotnum)
 {
-  // pack the emulation RAM into bytes so we don't waste flash space
-  pack_ram_into(packed_ram);
+  STORE_INDEX *x = &store_index[slotnum];
+  uint8_t dirty[IMAGE_PAGES];
+  int pages = 0;
+  int incremental;
+  STORE_META meta;
+  uint32_t seq;
+
+  if( !slot_valid(slotnum) )
+    {
+      return;
+    }
+
+  // May rewrite this slot, but keeps ram_base_seq in step
+  if( !store_make_room() )
+    {
+      printf("\nNot saved\n");
+      return;
+    }
   
-  // Erase slot
-  erase_slot(slotnum);
+  incremental = (slotnum == ram_slot) && (x->seq != 0) && (x->seq == ram_base_seq) && (x->num_deltas < STORE_MAX_DELTAS);
+
+  if( incremental && !any_dirty() )
+    {
+      printf("\nNo changes\n");
+      return;
+    }
+
+  // Wait for the last save, so only one has pages off bus_dirty
+  flash_wait();
+
+  // Take the dirty pages and copy the image with core1 stopped, so the
+  // copy isn't half way through a program or variable update and agrees
+  // with the pages. A write once it's going again marks its page for
+  // next time.
+  if( !bus_pause() )
+    {
+      printf("\nBus busy, not saved\n");
+      core0_count[CORE0_BUSY]++;
+      return;
+    }
+
+  for(int p=0; p<IMAGE_PAGES; p++)
+    {
+#if PIO_BUS_ENGINE
+      dirty[p] = 1;
+#else
+      dirty[p] = bus_dirty[p];
+      if( dirty[p] )
+	{
+	  saving_pages |= 1 << p;
+	  bus_dirty[p] = 0;
+	}
+#endif
+      pages += dirty[p];
+    }
+
+  image_export(image_buf, IMAGE_SLOT);
+  bus_resume();
+
+  flash_job_start("Save slot", slotnum);
+  store_meta(slotnum, image_buf, 1, &meta);
+  save_name[0] = '\0';
+  saving_crc = meta.crc;
+  save_in_hand = incremental ? SAVE_DELTA : SAVE_FULL;
   
-  // Write the buffer back
-  flash_range_program(FLASH_SLOT_OFFSET + (FLASH_SLOT_SIZE * slotnum), (uint8_t *) &(packed_ram[0]), ROM_SIZE);
+  if( incremental )
+    {
+      uint8_t *data = flash_buf + FLASH_PAGE_SIZE;
+      uint8_t mask = 0;
+
+      for(int p=0; p<IMAGE_PAGES; p++)
+	{
+	  if( dirty[p] )
+	    {
+	      mask |= 1 << (p ^ 1);
+	    }
+	}
+
+      for(int sp=0; sp<IMAGE_PAGES; sp++)
+	{
+	  if( mask & (1 << sp) )
+	    {
+	      memcpy(data, image_buf + sp*FLASH_PAGE_SIZE, FLASH_PAGE_SIZE);
+	      data += FLASH_PAGE_SIZE;
+	    }
+	}
+
+      if( (seq = store_append(STORE_DELTA, slotnum, ram_base_seq, mask, pages, STORE_RAW, pages*FLASH_PAGE_SIZE, &meta)) == 0 )
+	{
+	  mark_all_dirty();
+	}
+      printf("\nSaving %d pages\n", pages);
+    }
+  else
+    {
+      seq = ram_base_seq = store_append_full(slotnum, image_buf, &meta);
+      x->bad = 0;
+      printf("\nSaving %u bytes\n", flash_job.bytes_total);
+    }
 
-  printf("\nData written\n");
+  if( seq != 0 )
+    {
+      flash_job.done = save_done;
+    }
+  else
+    {
+      save_done(0);
+    }
   
+  flash_job_go();
+
+  ram_slot = (ram_base_seq != 0) ? slotnum : -1;
 }
 
 // Displays (packed, as bytes) RAM
-// Data can be inverted
 
-void display_ram_at(uint8_t *ptr, int length, int invert)
+void display_ram_at(uint8_t *ptr, int length)
 {
   for(int i=0; i<length; i++)
     {
@@ -708,14 +3561,7 @@ void display_ram_at(uint8_t *ptr, int length, int invert)
 	{
 	  printf("\n%04X: ", i);
 	}
-      if( invert)
-	{
-	  printf(" %02X", (*ptr) ^ 0xFF);
-	}
-      else
-	{
-	  printf(" %02X", *ptr);
-	}
+      printf(" %02X", *ptr);
       
       ptr++;
     }
@@ -724,14 +3570,123 @@ void display_ram_at(uint8_t *ptr, int length, int invert)
 void cli_display_program_slot(void)
 {
   
+  if( !slot_valid(parameter) )
+    {
+      return;
+    }
+  
   printf("\nSlot %d\n", parameter);
 
+  // Slots hold bus polarity
+  slot_read(parameter, image_buf, IMAGE_INVERT);
+
   // First dump in hex
-  display_ram_at(flash_slot_contents+parameter*FLASH_SLOT_SIZE, ROM_SIZE_BYTES, INVERT);
+  display_ram_at(image_buf, ROM_SIZE_BYTES);
 
   printf("\n\n");
 }
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compressed image transfer
+//
+// 'x' sends the RAM as a SNAP_WIRE_HEADER and a canonical stream, 'X'
+// takes one back. host_tools/snap_tool talks to both.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#define SNAP_WIRE_TIMEOUT_US  1000000
+
+void cli_snapshot_dump(void)
+{
+  SNAP_WIRE_HEADER hdr;
+  int len;
+  
+  image_export(image_buf, IMAGE_CANONICAL);
+  len = snap_encode(snap_buf, sizeof(snap_buf), image_buf, ROM_SIZE_BYTES, &snap_state);
+  
+  hdr.magic      = SNAP_WIRE_MAGIC;
+  hdr.version    = SNAP_WIRE_VERSION;
+  hdr.flags      = IMAGE_CANONICAL;
+  hdr.raw_length = ROM_SIZE_BYTES;
+  hdr.length     = len;
+  hdr.crc        = checksum(image_buf, ROM_SIZE_BYTES);
+
+  // Raw, no CR/LF translation
+  stdio_flush();
+  for(int i=0; i<sizeof(hdr); i++)
+    {
+      putchar_raw(((uint8_t *)&hdr)[i]);
+    }
+  for(int i=0; i<len; i++)
+    {
+      putchar_raw(snap_buf[i]);
+    }
+  stdio_flush();
+}
+
+// Read n bytes, 0 if the host stops sending
+int read_raw(uint8_t *dest, int n)
+{
+  for(int i=0; i<n; i++)
+    {
+      int c = getchar_timeout_us(SNAP_WIRE_TIMEOUT_US);
+
+      if( c == PICO_ERROR_TIMEOUT )
+	{
+	  return(0);
+	}
+      dest[i] = c;
+    }
+  return(1);
+}
+
+void cli_snapshot_load(void)
+{
+  SNAP_WIRE_HEADER hdr;
+  int ok;
+  
+  if( !read_raw((uint8_t *)&hdr, sizeof(hdr)) )
+    {
+      printf("\nTimed out");
+      return;
+    }
+
+  if( (hdr.magic != SNAP_WIRE_MAGIC) || (hdr.version != SNAP_WIRE_VERSION) || (hdr.flags != IMAGE_CANONICAL)
+      || (hdr.raw_length != ROM_SIZE_BYTES) || (hdr.length > sizeof(snap_buf)) )
+    {
+      printf("\nNot a %d byte canonical image", ROM_SIZE_BYTES);
+      return;
+    }
+  
+  if( !read_raw(snap_buf, hdr.length) )
+    {
+      printf("\nTimed out");
+      return;
+    }
+
+  // Checked before the RAM is touched
+  ok = (snap_decode(image_buf, ROM_SIZE_BYTES, snap_buf, hdr.length, 0) == ROM_SIZE_BYTES)
+    && (checksum(image_buf, ROM_SIZE_BYTES) == hdr.crc);
+
+  if( !ok )
+    {
+      printf("\nBad image, %u bytes\n", hdr.length);
+      return;
+    }
+  
+  if( !image_import(image_buf, IMAGE_CANONICAL) )
+    {
+      printf("\nBus busy, not loaded\n");
+      return;
+    }
+
+  // The RAM isn't what was loaded from a slot
+  mark_all_dirty();
+  
+  printf("\nLoaded, %u bytes\n", hdr.length);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -776,6 +3731,31 @@ SERIAL_COMMAND serial_cmds[] =
     "Erase program slot",
     cli_erase_program_slot,
    },
+   {
+    'i',
+    "List program slots",
+    cli_list_slots,
+   },
+   {
+    'N',
+    "Name the next save (a line follows)",
+    cli_set_name,
+   },
+   {
+    'c',
+    "Set clock to parameter (Unix time)",
+    cli_set_clock,
+   },
+   {
+    'k',
+    "Check CRCs of the RAM and slots",
+    cli_checksum,
+   },
+   {
+    'P',
+    "Power fail save status",
+    cli_power_fail,
+   },
    {
     'D',
     "Display program slot",
@@ -811,6 +3791,76 @@ SERIAL_COMMAND serial_cmds[] =
     "Display trace",
     cli_display_trace,
    },
+   {
+    'o',
+    "Stop trace",
+    cli_stop_trace,
+   },
+   {
+    'Y',
+    "Set trace trigger (a line follows, empty to clear)",
+    cli_set_trigger,
+   },
+   {
+    'U',
+    "Stream trace over USB (parameter 1 for raw), or stop",
+    cli_trace_stream,
+   },
+   {
+    'v',
+    "Watch the byte at address, or stop watching it",
+    cli_watch,
+   },
+   {
+    'V',
+    "List watched bytes (parameter 1 to clear them)",
+    cli_watch_list,
+   },
+   {
+    'l',
+    "Bus latency test",
+    cli_latency_test,
+   },
+   {
+    'g',
+    "Bus latency histograms, then clear",
+    cli_latency_histogram,
+   },
+   {
+    'G',
+    "Binary dump of bus latency histograms",
+    cli_latency_dump,
+   },
+   {
+    'p',
+    "Speculative read hit rate, then clear",
+    cli_speculation_stats,
+   },
+   {
+    'b',
+    "Bus monitor counts and log since last time",
+    cli_bus_monitor,
+   },
+   {
+    'r',
+    "RAM regions in use",
+    cli_regions,
+   },
+   {
+    'x',
+    "Binary dump of RAM, compressed",
+    cli_snapshot_dump,
+   },
+   {
+    'X',
+    "Binary load of RAM, compressed",
+    cli_snapshot_load,
+   },
+   {
+    'f',
+    "Flash writer and snapshot store status",
+    cli_flash_status,
+   },
    {
     '0',
     "*Digit",
@@ -932,7 +3982,7 @@ int main()
   
   for (int i=0; i<NUM_ADDR; i++)
     {
-      set_gpio_output(address_pins[i]);
+      set_gpio_output(A0_PIN+i);
     }
 
   while(1)
@@ -969,7 +4019,7 @@ int main()
   
   for (int i=0; i<NUM_ADDR; i++)
     {
-      set_gpio_output(address_pins[i]);
+      set_gpio_output(A0_PIN+i);
     }
 
     for (int i=0; i< NUM_DATA; i++)
@@ -983,7 +4033,7 @@ int main()
       
       for (int i=0; i<NUM_ADDR; i++)
 	{
-	  gpio_put(address_pins[i], count & (1 <<i));
+	  gpio_put(A0_PIN+i, count & (1 <<i));
 	}
 
       for (int i=0; i<NUM_DATA; i++)
@@ -1007,6 +4057,10 @@ int main()
 #define OVERCLOCK 270000
 //#define OVERCLOCK 360000
 
+#if !PIO_BUS_ENGINE && !UPD444_RELEASE_OK_KHZ(OVERCLOCK, UPD444_GRADE_T_HZ_NS(UPD444_GRADE))
+#error "OVERCLOCK is too low to let go of the bus within tHZ of UPD444_GRADE, see host_tools/hold_timing"
+#endif
+
   #if OVERCLOCK > 270000
   /* Above this speed needs increased voltage */
   vreg_set_voltage(VREG_VOLTAGE_1_20);
@@ -1016,28 +4070,54 @@ int main()
   /* Overclock */
   set_sys_clock_khz( OVERCLOCK, 1 );
 
-  // Put stdio init here as it mucks up gpio0/1
-  
-  stdio_init_all();
-    
   for (int i=0; i<NUM_ADDR; i++)
     {
-      set_gpio_input(address_pins[i]);
+      set_gpio_input(A0_PIN+i);
     }
 
   for( int i=0; i< NUM_DATA; i++)
     {
-      set_gpio_input(data_pins[i]);
+      set_gpio_input(D0_PIN+i);
+    }
+  
+  for( int i=0; i<NUM_CE; i++)
+    {
+      set_gpio_input(CE0_PIN+i);
     }
   
-  set_gpio_input(CE0_PIN);
-  set_gpio_input(CE1_PIN);
-  set_gpio_input(CE2_PIN);
-  set_gpio_input(CE3_PIN);
-  set_gpio_input(CE4_PIN);
   set_gpio_input(W_PIN);
 
+  // The RAM is filled before the bus is served, so the FX702P never
+  // reads what the SRAM powered up with. USB comes after. An embedded
+  // image is already there, copied in with the rest of the data.
+#if INIT_RAM && !EMBEDDED_IMAGE
+  for(int i=0; i<1024*4; i++)
+    {
+      SET_RAM_NIBBLE(i, 0xF);
+    }
+#endif
+
+  checksum_init();
+
+  uint32_t scan_start = time_us_32();
+
+  store_scan();
+  boot_scan_us = time_us_32() - scan_start;
+  boot_restore();
+
+#if PIO_BUS_ENGINE
+  pio_bus_init();
+#else
+  bus_engine_init(clock_get_hz(clk_sys));
   multicore_launch_core1(ram_emulate);
+#endif
+
+  boot_served_us = time_us_32();
+
+  // Stdio is USB only (CMakeLists.txt), so this leaves gpio0/1 alone.
+  // TinyUSB is ours to start, see tusb_config.h
+  tusb_init();
+  stdio_init_all();
 
   sleep_ms(2000);
   
@@ -1047,25 +4127,25 @@ int main()
   printf("\n| Replacement                  |");
   printf("\n/------------------------------/");
   printf("\n");
-  
-  printf("\nSetting GPIOs...");
 
-#if INIT_RAM
-  for(int i=0; i<1024*4; i++)
-    {
-      rom_data[i] = 0xFF;
-    }
+#if !PIO_BUS_ENGINE
+  printf("\nData hold %u cycles after CE, %u to %u ns",
+	 bus_hold_cycles,
+	 (uint32_t)upd444_cycles_to_ns(upd444_hold_min(clock_get_hz(clk_sys)), clock_get_hz(clk_sys)),
+	 (uint32_t)upd444_cycles_to_ns(upd444_hold_max(clock_get_hz(clk_sys)), clock_get_hz(clk_sys)));
 #endif
 
-#if LOAD_RAM
-  for(int i=0; i<ROM_SIZE/2; i++)
-    {
-      int ib = rom_data_load[i];
+  boot_report();
+  
+  // Now a bad slot can be reported
+  store_verify();
 
-      BYTE_TO_ROM_DATA(i, ib);
+#if POWER_FAIL_PIN >= 0
+  power_fail_init();
+#endif
 
-      
-    }
+#if AUTOSAVE_MS
+  absolute_time_t next_autosave = make_timeout_time_ms(AUTOSAVE_MS);
 #endif
   
   // Sit in a loop and do nothing on this core for now.
@@ -1073,7 +4153,24 @@ int main()
   while(1)
     {
       serial_loop();
-      
+      flash_writer_step();
+      trace_stream_poll();
+      watch_poll();
+
+#if POWER_FAIL_PIN >= 0
+      power_fail_poll();
+#endif
+
+#if AUTOSAVE_MS
+      if( time_reached(next_autosave) )
+	{
+	  if( (ram_slot >= 0) && !flash_busy() && any_dirty() )
+	    {
+	      save_ram(ram_slot);
+	    }
+	  next_autosave = make_timeout_time_ms(AUTOSAVE_MS);
+	}
+#endif
     }
   
 }
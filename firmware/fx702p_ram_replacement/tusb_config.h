@@ -0,0 +1,29 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// TinyUSB configuration
+//
+// The firmware links tinyusb_device itself, so the SDK's stdio_usb uses
+// this and usb_descriptors.c instead of its own: the CDC interface for
+// stdio, and a vendor interface that streams the bus trace (driven from
+// fx702p_ram_replacement.c, see common/trace_stream.h).
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#ifndef TUSB_CONFIG_H
+#define TUSB_CONFIG_H
+
+#define CFG_TUSB_RHPORT0_MODE    (OPT_MODE_DEVICE)
+
+#define CFG_TUD_ENDPOINT0_SIZE   64
+
+// As stdio_usb's own configuration
+#define CFG_TUD_CDC              1
+#define CFG_TUD_CDC_RX_BUFSIZE   256
+#define CFG_TUD_CDC_TX_BUFSIZE   256
+#define CFG_TUD_CDC_EP_BUFSIZE   64
+
+// The trace interface is an application driver, not TinyUSB's vendor
+// class, so frames go to the endpoint without passing through a FIFO
+#define CFG_TUD_VENDOR           0
+
+#endif
@@ -0,0 +1,122 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// USB descriptors
+//
+// stdio_usb's CDC interface, as the SDK describes it, then the bus trace
+// interface: vendor specific with a single bulk IN endpoint. See
+// tusb_config.h and common/trace_stream.h.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "tusb.h"
+#include "pico/unique_id.h"
+
+#include "trace_stream.h"
+
+#define ITF_NUM_CDC         0
+#define ITF_NUM_CDC_DATA    1
+#define ITF_NUM_TRACE       TRACE_USB_INTERFACE
+#define ITF_NUM_TOTAL       3
+
+enum
+  {
+   STRID_LANGID,
+   STRID_MANUFACTURER,
+   STRID_PRODUCT,
+   STRID_SERIAL,
+   STRID_CDC,
+   STRID_TRACE,
+  };
+
+#define EP_CDC_NOTIFY       0x81
+#define EP_CDC_OUT          0x02
+#define EP_CDC_IN           0x82
+
+#define TRACE_DESC_LEN      (9 + 7)
+#define CONFIG_TOTAL_LEN    (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TRACE_DESC_LEN)
+
+static const tusb_desc_device_t device_desc =
+  {
+   .bLength            = sizeof(tusb_desc_device_t),
+   .bDescriptorType    = TUSB_DESC_DEVICE,
+   .bcdUSB             = 0x0200,
+   .bDeviceClass       = TUSB_CLASS_MISC,
+   .bDeviceSubClass    = MISC_SUBCLASS_COMMON,
+   .bDeviceProtocol    = MISC_PROTOCOL_IAD,
+   .bMaxPacketSize0    = CFG_TUD_ENDPOINT0_SIZE,
+   .idVendor           = TRACE_USB_VID,
+   .idProduct          = TRACE_USB_PID,
+   .bcdDevice          = 0x0100,
+   .iManufacturer      = STRID_MANUFACTURER,
+   .iProduct           = STRID_PRODUCT,
+   .iSerialNumber      = STRID_SERIAL,
+   .bNumConfigurations = 1,
+  };
+
+static const uint8_t config_desc[CONFIG_TOTAL_LEN] =
+  {
+   TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 250),
+   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC, STRID_CDC, EP_CDC_NOTIFY, 8, EP_CDC_OUT, EP_CDC_IN, 64),
+
+   // Trace interface and its endpoint
+   9, TUSB_DESC_INTERFACE, ITF_NUM_TRACE, 0, 1, TUSB_CLASS_VENDOR_SPECIFIC, TRACE_USB_SUBCLASS, 0, STRID_TRACE,
+   7, TUSB_DESC_ENDPOINT, TRACE_USB_EP, TUSB_XFER_BULK, U16_TO_U8S_LE(64), 0,
+  };
+
+static char serial[2 * PICO_UNIQUE_BOARD_ID_SIZE_BYTES + 1];
+
+static const char *const strings[] =
+  {
+   [STRID_MANUFACTURER] = "Raspberry Pi",
+   [STRID_PRODUCT]      = "FX702P RAM",
+   [STRID_SERIAL]       = serial,
+   [STRID_CDC]          = "FX702P RAM CDC",
+   [STRID_TRACE]        = "FX702P RAM trace",
+  };
+
+const uint8_t *tud_descriptor_device_cb(void)
+{
+  return((const uint8_t *)&device_desc);
+}
+
+const uint8_t *tud_descriptor_configuration_cb(uint8_t index)
+{
+  (void)index;
+  return(config_desc);
+}
+
+const uint16_t *tud_descriptor_string_cb(uint8_t index, uint16_t langid)
+{
+  static uint16_t desc[32];
+  const char *s;
+  int len;
+
+  (void)langid;
+
+  if( index == STRID_LANGID )
+    {
+      desc[1] = 0x0409;
+      len = 1;
+    }
+  else
+    {
+      if( index >= sizeof(strings)/sizeof(strings[0]) )
+	{
+	  return(NULL);
+	}
+
+      if( serial[0] == '\0' )
+	{
+	  pico_get_unique_board_id_string(serial, sizeof(serial));
+	}
+
+      s = strings[index];
+      for(len=0; (len < 31) && (s[len] != '\0'); len++)
+	{
+	  desc[1+len] = s[len];
+	}
+    }
+
+  desc[0] = (TUSB_DESC_STRING << 8) | (2*len + 2);
+  return(desc);
+}
@@ -0,0 +1,253 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Chip select and address decode benchmark
+//
+// Runs the switch/XOR/multiply decode that ram_emulate() used to do and
+// the table decode it does now over the same stream of GPIO samples,
+// checks they give the same nibble and prints the time per decode for
+// each. The old decode indexed the image in canonical address order, the
+// new one in bus order (see common/ram_image.h), so the indexes are
+// compared with the address flipped.
+//
+// The sample stream looks like the FX702P bus: mostly runs of ascending
+// addresses on one chip, with the odd stray select pattern.
+//
+// Also checks the compile time decode tables from common/upd444_bus.h
+// against a table built the obvious way.
+//
+// Usage: decode_bench [samples [passes]]
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+// Must match fx702p_ram_replacement.c
+#define BUS_NUM_CE         4
+#define BUS_ADDR_BITS      10
+#define BUS_A0_PIN         0
+#define BUS_D0_PIN         10
+#define BUS_CE0_PIN        14
+#define BUS_W_PIN          19
+#define BUS_ADDR_INVERTED  1
+
+#include "upd444_bus.h"
+
+#define ROM_SINK     ROM_SIZE
+
+// As upd444_engine.h builds them
+#define CE_BASE_ENTRY(P)   BUS_CE_BASE(P, 0)
+#define CE_CHIP_ENTRY(P)   BUS_CE_CHIP(P)
+
+const unsigned int ce_base[CE_MASK+1] = BUS_CE_TABLE(CE_BASE_ENTRY);
+const uint8_t ce_chip[CE_MASK+1] = BUS_CE_TABLE(CE_CHIP_ENTRY);
+
+// Check the tables against a loop over the one-hot patterns
+int check_ce_table(void)
+{
+  for(int ce=0; ce<=CE_MASK; ce++)
+    {
+      int sel = ce ^ CE_MASK;
+      unsigned int base = 0;
+      int chip_num = NUM_CE;
+
+      for(int chip=0; chip<NUM_CE; chip++)
+	{
+	  if( sel == (1 << chip) )
+	    {
+	      base = chip*RAM_CE_SIZE;
+	      chip_num = chip;
+	    }
+	}
+
+      if( (ce_base[ce] != base) || (ce_chip[ce] != chip_num) )
+	{
+	  fprintf(stderr, "Decode table wrong for CE %X\n", ce);
+	  return(0);
+	}
+    }
+
+  return(1);
+}
+
+// The decode as it was, unknown patterns go to the sink
+static inline unsigned int decode_switch(uint32_t gpio_states)
+{
+  int selbits = (gpio_states & (CE_MASK << CE0_PIN)) >> CE0_PIN;
+  int selnum = 4;
+  unsigned int addr;
+
+  switch(selbits)
+    {
+    case 0x0e:
+      selnum = 0;
+      break;
+
+    case 0x0D:
+      selnum = 1;
+      break;
+
+    case 0x0B:
+      selnum = 2;
+      break;
+
+    case 0x07:
+      selnum = 3;
+      break;
+    }
+
+  addr = ADDRESS_MASK ^ ((gpio_states >> A0_PIN) & ADDRESS_MASK);
+
+  if( selnum == 4 )
+    {
+      return(ROM_SINK + addr);
+    }
+
+  return(addr+selnum*RAM_CE_SIZE);
+}
+
+// The engine skips a bad select, the sink stands in for that here
+static inline unsigned int decode_table(uint32_t gpio_states)
+{
+  int selbits = (gpio_states >> CE0_PIN) & CE_MASK;
+  unsigned int bus_addr = (gpio_states >> A0_PIN) & ADDRESS_MASK;
+
+  if( ce_chip[selbits] == NUM_CE )
+    {
+      return(ROM_SINK + bus_addr);
+    }
+
+  return(ce_base[selbits] + bus_addr);
+}
+
+// Build a bus-like stream of samples
+void make_samples(uint32_t *s, int n)
+{
+  static const uint32_t one_chip[NUM_CE] = { 0x0e, 0x0D, 0x0B, 0x07 };
+  int i = 0;
+
+  srand(702);
+
+  while( i < n )
+    {
+      uint32_t ce = one_chip[rand() % NUM_CE];
+      unsigned int addr = rand() & ADDRESS_MASK;
+      int run = 1 + (rand() % 32);
+
+      // About one in 64 runs is a glitch on the selects
+      if( (rand() % 64) == 0 )
+	{
+	  ce = rand() & CE_MASK;
+	}
+
+      for(int r=0; (r<run) && (i<n); r++, i++)
+	{
+	  // Bus address is inverted
+	  s[i] = (ce << CE0_PIN) | ((ADDRESS_MASK ^ ((addr + r) & ADDRESS_MASK)) << A0_PIN);
+	}
+    }
+}
+
+double now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1.0e9 + ts.tv_nsec);
+}
+
+// Time a decode, the checksum stops the compiler dropping the loop. A
+// macro rather than a function pointer so the decode is inlined, as it
+// is in the firmware.
+#define TIME_DECODE(FN, S, N, PASSES, SUM, NS)			\
+  {								\
+    double start = now_ns();					\
+								\
+    SUM = 0;							\
+    for(int p=0; p<(PASSES); p++)				\
+      {								\
+	for(int i=0; i<(N); i++)				\
+	  {							\
+	    SUM += FN((S)[i]);				\
+	  }							\
+      }								\
+    NS = (now_ns() - start) / ((double)(N) * (PASSES));	\
+  }
+
+int main(int argc, char *argv[])
+{
+  int n = 1000000;
+  int passes = 20;
+  unsigned long sum_switch, sum_table;
+
+  if( argc > 1 )
+    {
+      n = atoi(argv[1]);
+    }
+
+  if( argc > 2 )
+    {
+      passes = atoi(argv[2]);
+    }
+
+  if( (n <= 0) || (passes <= 0) )
+    {
+      fprintf(stderr, "Usage: decode_bench [samples [passes]]\n");
+      return(2);
+    }
+
+  uint32_t *samples = malloc(n * sizeof(uint32_t));
+
+  if( samples == NULL )
+    {
+      fprintf(stderr, "No memory for %d samples\n", n);
+      return(2);
+    }
+
+  if( !check_ce_table() )
+    {
+      return(1);
+    }
+
+  make_samples(samples, n);
+
+  // Every sample must decode to the same nibble
+  for(int i=0; i<n; i++)
+    {
+      if( decode_switch(samples[i]) != (decode_table(samples[i]) ^ ADDRESS_MASK) )
+	{
+	  fprintf(stderr, "Mismatch at sample %d (%08X)\n", i, samples[i]);
+	  return(1);
+	}
+    }
+
+  // Check all 16 select patterns against the old decode as well
+  for(uint32_t ce=0; ce<=CE_MASK; ce++)
+    {
+      for(uint32_t a=0; a<=ADDRESS_MASK; a++)
+	{
+	  uint32_t g = (ce << CE0_PIN) | (a << A0_PIN);
+
+	  if( decode_switch(g) != (decode_table(g) ^ ADDRESS_MASK) )
+	    {
+	      fprintf(stderr, "Mismatch for CE %X address %03X\n", ce, a);
+	      return(1);
+	    }
+	}
+    }
+
+  double t_switch, t_table;
+
+  TIME_DECODE(decode_switch, samples, n, passes, sum_switch, t_switch);
+  TIME_DECODE(decode_table,  samples, n, passes, sum_table,  t_table);
+
+  printf("%d samples, %d passes, decodes match\n", n, passes);
+  printf("switch/xor/multiply %6.2f ns per decode\n", t_switch);
+  printf("table               %6.2f ns per decode\n", t_table);
+  printf("(checksums %lX %lX)\n", sum_switch, sum_table);
+
+  free(samples);
+  return(0);
+}
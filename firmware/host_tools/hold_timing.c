@@ -0,0 +1,116 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Data hold timing model
+//
+// For a range of clk_sys frequencies, works out the hold the bus engine
+// will use (common/upd444_timing.h) and the best and worst case time the
+// data stays on the bus after CE rises. Each is checked against the
+// uPD444 datasheet: at least tOH, and gone within tHZ of the part being
+// replaced.
+//
+// Usage: hold_timing [kHz ...]
+//
+// With no arguments the OVERCLOCK settings used in the firmware and a few
+// slower clocks are modelled. Given clocks, exits non-zero if any of them
+// fails tOH or the uPD444 tHZ.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "upd444_timing.h"
+
+uint32_t default_khz[] =
+  {
+   48000, 100000, 125000, 133000, 200000, 270000, 360000,
+  };
+
+#define NUM_DEFAULT (sizeof(default_khz)/sizeof(default_khz[0]))
+
+// tHZ of each part, worst first
+struct
+{
+  char *name;
+  int thz_ns;
+} parts[] =
+  {
+   {"uPD444",   UPD444_T_HZ_NS},
+   {"-1",       UPD444_1_T_HZ_NS},
+   {"-2",       UPD444_2_T_HZ_NS},
+   {"-3",       UPD444_3_T_HZ_NS},
+  };
+
+#define NUM_PARTS (sizeof(parts)/sizeof(parts[0]))
+
+// Returns 1 if the clock meets tOH and the uPD444 tHZ
+int model(uint32_t khz)
+{
+  uint32_t hz = khz * 1000;
+  double min_ns = upd444_cycles_to_ns(upd444_hold_min(hz), hz);
+  double max_ns = upd444_cycles_to_ns(upd444_hold_max(hz), hz);
+  int ok = (min_ns >= UPD444_T_OH_NS) && upd444_release_ok(hz, UPD444_T_HZ_NS);
+
+  printf("%7.1f  %6u  %4u-%-4u  %6.1f-%-6.1f  %-4s",
+	 khz / 1000.0,
+	 upd444_hold_cycles(hz),
+	 upd444_hold_min(hz),
+	 upd444_hold_max(hz),
+	 min_ns,
+	 max_ns,
+	 (min_ns >= UPD444_T_OH_NS) ? "ok" : "FAIL");
+
+  for(int p=0; p<NUM_PARTS; p++)
+    {
+      printf("  %-6s", upd444_release_ok(hz, parts[p].thz_ns) ? "ok" : "FAIL");
+    }
+  printf("\n");
+
+  return(ok);
+}
+
+int main(int argc, char *argv[])
+{
+  int failed = 0;
+
+  printf("Data hold after CE rises, tOH >= %dns\n\n", UPD444_T_OH_NS);
+  printf("%7s  %6s  %-9s  %-13s  %-4s", "MHz", "wait", "cycles", "ns", "tOH");
+  for(int p=0; p<NUM_PARTS; p++)
+    {
+      printf("  %-6s", parts[p].name);
+    }
+  printf("\n");
+
+  printf("%7s  %6s  %-9s  %-13s  %-4s", "", "", "", "", "");
+  for(int p=0; p<NUM_PARTS; p++)
+    {
+      printf("  %-6d", parts[p].thz_ns);
+    }
+  printf("  tHZ ns\n");
+
+  if( argc > 1 )
+    {
+      for(int i=1; i<argc; i++)
+	{
+	  uint32_t khz = strtoul(argv[i], NULL, 0);
+
+	  if( khz == 0 )
+	    {
+	      fprintf(stderr, "Usage: hold_timing [kHz ...]\n");
+	      return(2);
+	    }
+
+	  failed |= !model(khz);
+	}
+    }
+  else
+    {
+      for(int i=0; i<NUM_DEFAULT; i++)
+	{
+	  model(default_khz[i]);
+	}
+    }
+
+  return(failed);
+}
@@ -0,0 +1,141 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// RAM image embedding
+//
+// Turns a canonical RAM image (as the 'D' dump, 'x' and snap_tool give
+// them) into the initialiser of the RAM replacement firmware's rom_data[],
+// already in the layout the bus engine serves from. The firmware's
+// CMakeLists.txt runs it when FX702P_IMAGE is set, so the image is in the
+// flash binary and the startup copy into RAM is all that happens to it.
+//
+// Usage: image_embed <image> <prefix>
+//
+// Writes <prefix>.h, the name and CRC32 of the image, and <prefix>_data.h,
+// the initialiser for both bus engines:
+//
+//   scratch/core1  packed bus image (ram_image.h)
+//   PIO            a nibble per byte, chip n in 1K window (1 << n) of the
+//                  16K image, see fx702p_ram_bus.pio
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ram_image.h"
+#include "crc32.h"
+
+// Four uPD444s
+#define IMAGE_CHIPS  4
+#define IMAGE_BYTES  (IMAGE_CHIPS * RAM_IMAGE_CHIP_BYTES)
+#define CHIP_NIBBLES (2 * RAM_IMAGE_CHIP_BYTES)
+
+#define PER_LINE     16
+
+uint8_t image[IMAGE_BYTES + 1];
+uint8_t bus[IMAGE_BYTES];
+
+char *base_name(char *path)
+{
+  char *s = strrchr(path, '/');
+
+  return( (s == NULL) ? path : s+1 );
+}
+
+FILE *open_output(char *prefix, char *suffix, char *from)
+{
+  char path[1024];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s%s", prefix, suffix);
+  if( (fp = fopen(path, "w")) == NULL )
+    {
+      perror(path);
+      return(NULL);
+    }
+
+  fprintf(fp, "// Generated by image_embed from %s, don't edit\n\n", from);
+  return(fp);
+}
+
+void write_bytes(FILE *fp, uint8_t *p, int len)
+{
+  for(int i=0; i<len; i++)
+    {
+      fprintf(fp, "%s0x%02X,%s",
+	      (i % PER_LINE) == 0 ? "   " : "",
+	      p[i],
+	      ((i % PER_LINE) == PER_LINE-1) || (i == len-1) ? "\n" : " ");
+    }
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *fp;
+  char *name;
+  int len;
+
+  if( argc != 3 )
+    {
+      fprintf(stderr, "Usage: image_embed <image> <prefix>\n");
+      return(2);
+    }
+
+  name = base_name(argv[1]);
+
+  if( (fp = fopen(argv[1], "rb")) == NULL )
+    {
+      perror(argv[1]);
+      return(1);
+    }
+  len = fread(image, 1, sizeof(image), fp);
+  fclose(fp);
+
+  if( len != IMAGE_BYTES )
+    {
+      fprintf(stderr, "%s: images are %d bytes\n", argv[1], IMAGE_BYTES);
+      return(1);
+    }
+
+  ram_image_convert(bus, image, IMAGE_BYTES, IMAGE_CANONICAL);
+
+  if( (fp = open_output(argv[2], ".h", name)) == NULL )
+    {
+      return(1);
+    }
+  fprintf(fp, "#define EMBEDDED_IMAGE_NAME  \"%s\"\n", name);
+  fprintf(fp, "#define EMBEDDED_IMAGE_CRC   0x%08X\n", crc32_of(image, IMAGE_BYTES));
+  fclose(fp);
+
+  if( (fp = open_output(argv[2], "_data.h", name)) == NULL )
+    {
+      return(1);
+    }
+
+  fprintf(fp, "#if PIO_BUS_ENGINE\n");
+  for(int chip=0; chip<IMAGE_CHIPS; chip++)
+    {
+      uint8_t nibbles[CHIP_NIBBLES];
+
+      // Even bus addresses are the low nibble
+      for(int i=0; i<CHIP_NIBBLES; i++)
+	{
+	  nibbles[i] = (bus[chip*RAM_IMAGE_CHIP_BYTES + i/2] >> ((i & 1) * 4)) & 0xF;
+	}
+
+      fprintf(fp, "   [0x%04X] =\n", (1 << chip) * CHIP_NIBBLES);
+      write_bytes(fp, nibbles, CHIP_NIBBLES);
+    }
+  fprintf(fp, "#else\n");
+  write_bytes(fp, bus, IMAGE_BYTES);
+  fprintf(fp, "#endif\n");
+
+  if( fclose(fp) != 0 )
+    {
+      perror(argv[2]);
+      return(1);
+    }
+
+  return(0);
+}
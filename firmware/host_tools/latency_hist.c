@@ -0,0 +1,246 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus latency histogram reader
+//
+// Reads the binary dump the RAM replacement firmware sends for the 'G'
+// command and prints the histograms. Given two dumps it prints them side
+// by side, to compare firmware builds or OVERCLOCK settings.
+//
+// Usage: latency_hist <dump> [<dump>]
+//
+// A dump is either a file holding a capture of the serial output (the
+// header is searched for, so surrounding text doesn't matter) or the
+// serial device itself, in which case 'G' is sent and the reply read.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/select.h>
+
+#include "latency_stats.h"
+
+#define MAX_CAPTURE  (64*1024)
+
+typedef struct
+{
+  char *name;
+  LAT_DUMP_HEADER hdr;
+  LAT_STATS stats;
+} DUMP;
+
+char *lat_names[LAT_NUM] =
+  {
+   "CE low to data driven",
+   "Data driven to CE high",
+   "CE low time",
+  };
+
+// Read whatever arrives until the line goes quiet
+int read_device(char *path, uint8_t *buf, int max)
+{
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  int len = 0;
+
+  if( fd < 0 )
+    {
+      return(-1);
+    }
+
+  if( tcgetattr(fd, &tio) == 0 )
+    {
+      cfmakeraw(&tio);
+      tcsetattr(fd, TCSANOW, &tio);
+    }
+
+  tcflush(fd, TCIFLUSH);
+  if( write(fd, "G", 1) != 1 )
+    {
+      close(fd);
+      return(-1);
+    }
+
+  while( len < max )
+    {
+      fd_set rd;
+      struct timeval tv = { 1, 0 };
+      int n;
+
+      FD_ZERO(&rd);
+      FD_SET(fd, &rd);
+
+      if( select(fd+1, &rd, NULL, NULL, &tv) <= 0 )
+	{
+	  break;
+	}
+
+      n = read(fd, buf+len, max-len);
+      if( n <= 0 )
+	{
+	  break;
+	}
+      len += n;
+    }
+
+  close(fd);
+  return(len);
+}
+
+int read_file(char *path, uint8_t *buf, int max)
+{
+  FILE *fp = fopen(path, "rb");
+  int len;
+
+  if( fp == NULL )
+    {
+      return(-1);
+    }
+
+  len = fread(buf, 1, max, fp);
+  fclose(fp);
+  return(len);
+}
+
+int load_dump(char *path, DUMP *d)
+{
+  static uint8_t buf[MAX_CAPTURE];
+  int fd = open(path, O_RDONLY | O_NOCTTY | O_NONBLOCK);
+  int is_tty = (fd >= 0) && isatty(fd);
+  int len;
+
+  if( fd >= 0 )
+    {
+      close(fd);
+    }
+
+  len = is_tty ? read_device(path, buf, sizeof(buf)) : read_file(path, buf, sizeof(buf));
+
+  if( len < 0 )
+    {
+      perror(path);
+      return(0);
+    }
+
+  d->name = path;
+
+  for(int i=0; i+(int)sizeof(LAT_DUMP_HEADER)<=len; i++)
+    {
+      memcpy(&d->hdr, buf+i, sizeof(LAT_DUMP_HEADER));
+
+      if( d->hdr.magic != LAT_DUMP_MAGIC )
+	{
+	  continue;
+	}
+
+      if( (d->hdr.version != LAT_DUMP_VERSION) || (d->hdr.buckets != LAT_BUCKETS) || (d->hdr.length != sizeof(LAT_STATS)) )
+	{
+	  fprintf(stderr, "%s: dump version %d, %d buckets not supported\n", path, d->hdr.version, d->hdr.buckets);
+	  return(0);
+	}
+
+      if( i + sizeof(LAT_DUMP_HEADER) + sizeof(LAT_STATS) > len )
+	{
+	  fprintf(stderr, "%s: dump is truncated\n", path);
+	  return(0);
+	}
+
+      memcpy(&d->stats, buf+i+sizeof(LAT_DUMP_HEADER), sizeof(LAT_STATS));
+      return(1);
+    }
+
+  fprintf(stderr, "%s: no latency dump found\n", path);
+  return(0);
+}
+
+double to_ns(DUMP *d, uint32_t cycles)
+{
+  return(cycles * 1.0e9 / d->hdr.sys_hz);
+}
+
+uint32_t worst_cycles(DUMP *d)
+{
+  // Input synchronisers add two cycles
+  return(d->stats.poll_max + d->stats.max[LAT_CE_DATA] + 2);
+}
+
+int main(int argc, char *argv[])
+{
+  DUMP dumps[2];
+  int n = argc - 1;
+
+  if( (n < 1) || (n > 2) )
+    {
+      fprintf(stderr, "Usage: latency_hist <dump> [<dump>]\n");
+      return(2);
+    }
+
+  for(int i=0; i<n; i++)
+    {
+      if( !load_dump(argv[i+1], &dumps[i]) )
+	{
+	  return(1);
+	}
+    }
+
+  for(int i=0; i<n; i++)
+    {
+      DUMP *d = &dumps[i];
+
+      printf("%c: %s, %.1fMHz%s%s, %u reads, %u writes\n",
+	     'A'+i, d->name, d->hdr.sys_hz / 1.0e6,
+	     (d->hdr.build & LAT_BUILD_SCRATCH) ? ", scratch" : "",
+	     (d->hdr.build & LAT_BUILD_SPECULATIVE) ? ", speculative" : "",
+	     d->stats.reads, d->stats.writes);
+    }
+
+  for(int h=0; h<LAT_NUM; h++)
+    {
+      printf("\n%s\n", lat_names[h]);
+
+      for(int b=0; b<LAT_BUCKETS; b++)
+	{
+	  int used = 0;
+
+	  for(int i=0; i<n; i++)
+	    {
+	      used |= (dumps[i].stats.hist[h][b] != 0);
+	    }
+
+	  if( !used )
+	    {
+	      continue;
+	    }
+
+	  printf("  >=%7u cycles", lat_bucket_low(b));
+	  for(int i=0; i<n; i++)
+	    {
+	      printf("  %c %8.1fns %10u", 'A'+i, to_ns(&dumps[i], lat_bucket_low(b)), dumps[i].stats.hist[h][b]);
+	    }
+	  printf("\n");
+	}
+
+      printf("  max          ");
+      for(int i=0; i<n; i++)
+	{
+	  printf("   %c %7u cycles %8.1fns", 'A'+i, dumps[i].stats.max[h], to_ns(&dumps[i], dumps[i].stats.max[h]));
+	}
+      printf("\n");
+    }
+
+  printf("\nWorst CE to data (poll gap + CE low to data + 2)\n");
+  for(int i=0; i<n; i++)
+    {
+      DUMP *d = &dumps[i];
+
+      printf("  %c %u + %u + 2 = %u cycles, %.1fns, fewest CE wait passes %u\n",
+	     'A'+i, d->stats.poll_max, d->stats.max[LAT_CE_DATA], worst_cycles(d),
+	     to_ns(d, worst_cycles(d)), d->stats.spin_min);
+    }
+
+  return(0);
+}
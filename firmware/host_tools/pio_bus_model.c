@@ -0,0 +1,198 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Cycle model of the PIO/DMA uPD444G bus engine
+//
+// Walks the instruction sequences in fx702p_ram_bus.pio and the DMA hops
+// between them and prints the CE to data, CE to release and W to latch
+// times for a range of system clocks, against the uPD444 AC
+// characteristics from datasheets/UPD444-NEC.pdf.
+//
+// Usage: pio_bus_model [clock_khz [grade]]
+//
+// grade is 0 for the plain uPD444 (the default), 1, 2 or 3 for the -1, -2
+// and -3 parts. With a clock given the exit status is non zero if the read
+// path does not meet the chip select access time at that clock.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Must match .define HOLD_CYCLES in fx702p_ram_bus.pio
+#define HOLD_CYCLES      13
+
+// GPIO input synchroniser, two flops in front of every PIO input
+#define SYNC_CYCLES       2
+
+// DMA: DREQ seen to read issued, then one read and one write. A chained or
+// register triggered channel starts a cycle after the trigger. These are
+// the uncontended figures, bus contention adds to each access.
+#define DMA_DREQ_CYCLES   2
+#define DMA_START_CYCLES  1
+#define DMA_XFER_CYCLES   2
+
+typedef struct
+{
+  char *what;
+  int min;
+  int max;
+} PHASE;
+
+// CE falling to D0..D3 driven
+PHASE read_path[] =
+  {
+   {"input synchroniser",                SYNC_CYCLES, SYNC_CYCLES},
+   {"wait for poll sample (5 cycle loop)",         0,           4},
+   {"mov osr, out, out, jmp !y",                   4,           4},
+   {"jmp pin (W high)",                            1,           1},
+   {"mov isr, in, in, push",                       4,           4},
+   {"address DMA channel", DMA_DREQ_CYCLES+DMA_XFER_CYCLES, DMA_DREQ_CYCLES+DMA_XFER_CYCLES},
+   {"data DMA channel",   DMA_START_CYCLES+DMA_XFER_CYCLES, DMA_START_CYCLES+DMA_XFER_CYCLES},
+   {"pull completes",                              1,           1},
+   {"out pins, set pindirs",                       2,           2},
+  };
+
+// CE rising to D0..D3 released
+PHASE hold_path[] =
+  {
+   {"input synchroniser",                SYNC_CYCLES, SYNC_CYCLES},
+   {"wait for hold sample (4 cycle loop)",         0,           3},
+   {"mov osr, out, out, jmp y--",                  4,           4},
+   {"nop [HOLD_CYCLES]",               1+HOLD_CYCLES, 1+HOLD_CYCLES},
+   {"set pindirs",                                 1,           1},
+  };
+
+// W rising to data pins sampled
+PHASE latch_path[] =
+  {
+   {"input synchroniser",                SYNC_CYCLES, SYNC_CYCLES},
+   {"wait 1 pin W",                                1,           1},
+   {"mov osr, pins",                               1,           1},
+  };
+
+// W rising to the nibble being in the image
+PHASE commit_path[] =
+  {
+   {"W rise to data sampled",                      4,           4},
+   {"push address, out, in, push data",            4,           4},
+   {"address DMA channel", DMA_DREQ_CYCLES+DMA_XFER_CYCLES, DMA_DREQ_CYCLES+DMA_XFER_CYCLES},
+   {"data DMA channel",   DMA_START_CYCLES+DMA_XFER_CYCLES, DMA_START_CYCLES+DMA_XFER_CYCLES},
+  };
+
+// uPD444 AC characteristics in ns, plain part first
+typedef struct
+{
+  char *name;
+  int t_acs1;      // chip select access time
+  int t_oh;        // output hold from address change, min
+  int t_hz;        // chip deselect to output high Z, max
+  int t_dh;        // data hold after end of write, min
+} GRADE;
+
+GRADE grades[] =
+  {
+   {"uPD444",   450, 50, 100, 0},
+   {"uPD444-1", 300, 50,  80, 0},
+   {"uPD444-2", 250, 50,  70, 0},
+   {"uPD444-3", 200, 50,  60, 0},
+  };
+
+int clocks_khz[] = { 125000, 133000, 150000, 200000, 250000, 270000 };
+
+#define NUM_PHASES(P) (sizeof(P)/sizeof(PHASE))
+
+void path_cycles(PHASE *p, int n, int *min, int *max)
+{
+  *min = 0;
+  *max = 0;
+
+  for(int i=0; i<n; i++)
+    {
+      *min += p[i].min;
+      *max += p[i].max;
+    }
+}
+
+void print_path(char *title, PHASE *p, int n)
+{
+  int min, max;
+
+  printf("\n%s", title);
+  for(int i=0; i<n; i++)
+    {
+      printf("\n  %-40s %3d..%3d", p[i].what, p[i].min, p[i].max);
+    }
+  path_cycles(p, n, &min, &max);
+  printf("\n  %-40s %3d..%3d cycles\n", "total", min, max);
+}
+
+double cycles_to_ns(int cycles, int khz)
+{
+  return(cycles * 1.0e6 / khz);
+}
+
+int main(int argc, char *argv[])
+{
+  int check_khz = 0;
+  int grade = 0;
+  int rd_min, rd_max, hold_min, hold_max, latch_min, latch_max, commit_min, commit_max;
+  int fail = 0;
+
+  if( argc > 1 )
+    {
+      check_khz = atoi(argv[1]);
+    }
+
+  if( argc > 2 )
+    {
+      grade = atoi(argv[2]);
+      if( (grade < 0) || (grade >= sizeof(grades)/sizeof(GRADE)) )
+        {
+          fprintf(stderr, "Unknown grade %d\n", grade);
+          return(2);
+        }
+    }
+
+  GRADE *g = &grades[grade];
+
+  print_path("CE falling to data driven", read_path, NUM_PHASES(read_path));
+  print_path("CE rising to data released", hold_path, NUM_PHASES(hold_path));
+  print_path("W rising to data sampled", latch_path, NUM_PHASES(latch_path));
+  print_path("W rising to nibble stored", commit_path, NUM_PHASES(commit_path));
+
+  path_cycles(read_path,   NUM_PHASES(read_path),   &rd_min,     &rd_max);
+  path_cycles(hold_path,   NUM_PHASES(hold_path),   &hold_min,   &hold_max);
+  path_cycles(latch_path,  NUM_PHASES(latch_path),  &latch_min,  &latch_max);
+  path_cycles(commit_path, NUM_PHASES(commit_path), &commit_min, &commit_max);
+
+  printf("\n%s: tACS1 %dns, tHZ max %dns, tDH min %dns\n", g->name, g->t_acs1, g->t_hz, g->t_dh);
+  printf("\n   clock   CE->data (ns)   margin   CE->release (ns)   W->sample (ns)");
+
+  for(int i=0; i<sizeof(clocks_khz)/sizeof(int); i++)
+    {
+      int khz = clocks_khz[i];
+      double rd = cycles_to_ns(rd_max, khz);
+
+      printf("\n%8d   %5.1f..%5.1f   %6.1f   %6.1f..%6.1f%s   %5.1f",
+             khz,
+             cycles_to_ns(rd_min, khz), rd,
+             g->t_acs1 - rd,
+             cycles_to_ns(hold_min, khz), cycles_to_ns(hold_max, khz),
+             (cycles_to_ns(hold_max, khz) > g->t_hz) ? "*" : " ",
+             cycles_to_ns(latch_max, khz));
+    }
+  printf("\n\n* data held past tHZ, lower HOLD_CYCLES for this clock");
+  printf("\nData is sampled after W rises, the 444 only guarantees %dns of data hold.\n", g->t_dh);
+
+  if( check_khz != 0 )
+    {
+      double rd = cycles_to_ns(rd_max, check_khz);
+
+      printf("\nAt %dkHz worst case CE to data is %.1fns against %dns: %s\n",
+             check_khz, rd, g->t_acs1, (rd <= g->t_acs1) ? "OK" : "FAIL");
+
+      fail = (rd > g->t_acs1);
+    }
+
+  return(fail);
+}
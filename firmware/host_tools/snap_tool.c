@@ -0,0 +1,401 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Compressed RAM image tool
+//
+// Packs and unpacks the streams of common/snapshot_codec.h, and moves
+// images to and from the RAM replacement firmware with its 'x' and 'X'
+// commands. Images are canonical (what the FX702P program sees), as the
+// 'D' dump shows them.
+//
+// Usage: snap_tool pack <image> <packed>
+//        snap_tool unpack <packed> <image>
+//        snap_tool get <device> <image>
+//        snap_tool put <device> <image>
+//        snap_tool stats <image> ...
+//        snap_tool crc <image> ...
+//
+// A packed file is a SNAP_WIRE_HEADER and the stream, the same as goes
+// over the serial port. unpack takes a capture of the serial output too,
+// the header is searched for. stats prints the compressed and sparse
+// sizes and checks both decode back into each image layout the firmware
+// uses.
+//
+// crc prints the CRC32 of an image as the firmware's 'k' command does,
+// and of its slot format as 'i' lists it.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/select.h>
+
+#include "snapshot_codec.h"
+#include "crc32.h"
+
+#define MAX_IMAGE    (64*1024)
+#define MAX_PACKED   (MAX_IMAGE + MAX_IMAGE/SNAP_LITERAL_MAX + 1)
+#define MAX_CAPTURE  (MAX_PACKED + 4096)
+
+uint8_t image[MAX_IMAGE];
+uint8_t packed[MAX_PACKED];
+uint8_t capture[MAX_CAPTURE];
+uint8_t sparse_buf[MAX_PACKED];
+
+// Every byte of a cleared RAM, canonical
+#define CLEARED      0x00
+
+SNAP_STATE state;
+
+int read_file(char *path, uint8_t *buf, int max)
+{
+  FILE *fp = fopen(path, "rb");
+  int len;
+
+  if( fp == NULL )
+    {
+      perror(path);
+      return(-1);
+    }
+
+  len = fread(buf, 1, max, fp);
+  fclose(fp);
+  return(len);
+}
+
+int write_file(char *path, uint8_t *buf, int len)
+{
+  FILE *fp = fopen(path, "wb");
+
+  if( (fp == NULL) || (fwrite(buf, 1, len, fp) != len) )
+    {
+      perror(path);
+      if( fp != NULL )
+	{
+	  fclose(fp);
+	}
+      return(0);
+    }
+
+  fclose(fp);
+  return(1);
+}
+
+int open_device(char *path)
+{
+  int fd = open(path, O_RDWR | O_NOCTTY);
+  struct termios tio;
+
+  if( fd < 0 )
+    {
+      perror(path);
+      return(-1);
+    }
+
+  if( tcgetattr(fd, &tio) == 0 )
+    {
+      cfmakeraw(&tio);
+      tcsetattr(fd, TCSANOW, &tio);
+    }
+
+  tcflush(fd, TCIFLUSH);
+  return(fd);
+}
+
+// Read whatever arrives until the line goes quiet
+int read_quiet(int fd, uint8_t *buf, int max)
+{
+  int len = 0;
+
+  while( len < max )
+    {
+      fd_set rd;
+      struct timeval tv = { 1, 0 };
+      int n;
+
+      FD_ZERO(&rd);
+      FD_SET(fd, &rd);
+
+      if( select(fd+1, &rd, NULL, NULL, &tv) <= 0 )
+	{
+	  break;
+	}
+
+      n = read(fd, buf+len, max-len);
+      if( n <= 0 )
+	{
+	  break;
+	}
+      len += n;
+    }
+
+  return(len);
+}
+
+int image_ok(int len)
+{
+  if( (len <= 0) || (len % RAM_IMAGE_CHIP_BYTES) != 0 )
+    {
+      fprintf(stderr, "Images are a whole number of %d byte chips\n", RAM_IMAGE_CHIP_BYTES);
+      return(0);
+    }
+  return(1);
+}
+
+// Find a header in a capture and decode what follows, returns the image
+// length or -1
+int unpack(uint8_t *buf, int len, char *name)
+{
+  SNAP_WIRE_HEADER hdr;
+
+  for(int i=0; i+(int)sizeof(hdr)<=len; i++)
+    {
+      memcpy(&hdr, buf+i, sizeof(hdr));
+
+      if( hdr.magic != SNAP_WIRE_MAGIC )
+	{
+	  continue;
+	}
+
+      if( (hdr.version != SNAP_WIRE_VERSION) || (hdr.flags != IMAGE_CANONICAL) || (hdr.raw_length > MAX_IMAGE) )
+	{
+	  fprintf(stderr, "%s: version %d, flags %d, %u bytes not supported\n", name, hdr.version, hdr.flags, hdr.raw_length);
+	  return(-1);
+	}
+
+      if( i + sizeof(hdr) + hdr.length > len )
+	{
+	  fprintf(stderr, "%s: stream is truncated\n", name);
+	  return(-1);
+	}
+
+      if( (snap_decode(image, hdr.raw_length, buf+i+sizeof(hdr), hdr.length, 0) != hdr.raw_length)
+	  || (crc32_of(image, hdr.raw_length) != hdr.crc) )
+	{
+	  fprintf(stderr, "%s: stream is corrupt\n", name);
+	  return(-1);
+	}
+
+      return(hdr.raw_length);
+    }
+
+  fprintf(stderr, "%s: no packed image found\n", name);
+  return(-1);
+}
+
+// Header and stream for an image, returns the length
+int pack(int len)
+{
+  SNAP_WIRE_HEADER hdr;
+  int n = snap_encode(packed+sizeof(hdr), sizeof(packed)-sizeof(hdr), image, len, &state);
+
+  hdr.magic      = SNAP_WIRE_MAGIC;
+  hdr.version    = SNAP_WIRE_VERSION;
+  hdr.flags      = IMAGE_CANONICAL;
+  hdr.raw_length = len;
+  hdr.length     = n;
+  hdr.crc        = crc32_of(image, len);
+  memcpy(packed, &hdr, sizeof(hdr));
+
+  return(sizeof(hdr) + n);
+}
+
+double now_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1.0e6 + ts.tv_nsec / 1.0e3);
+}
+
+// Sizes and timing, and check decoding into each layout matches
+// ram_image_convert()
+int stats(char *path)
+{
+  static uint8_t expect[MAX_IMAGE];
+  static uint8_t got[MAX_IMAGE];
+  int flags[] = { 0, IMAGE_SLOT, IMAGE_INVERT, IMAGE_CANONICAL };
+  int len = read_file(path, image, sizeof(image));
+  int n;
+  int sparse;
+  double t0, t1, t2, t3;
+  int reps = 1000;
+
+  if( (len < 0) || !image_ok(len) )
+    {
+      return(0);
+    }
+
+  t0 = now_us();
+  for(int i=0; i<reps; i++)
+    {
+      n = snap_encode(packed, sizeof(packed), image, len, &state);
+    }
+  t1 = now_us();
+  for(int i=0; i<reps; i++)
+    {
+      snap_decode(got, len, packed, n, 0);
+    }
+  t2 = now_us();
+  for(int i=0; i<reps; i++)
+    {
+      sparse = snap_sparse_encode(sparse_buf, sizeof(sparse_buf), image, len, CLEARED);
+    }
+  t3 = now_us();
+
+  printf("%s: %d bytes\n", path, len);
+  printf("  compressed %5d, %4.1f:1, %2d flash pages, encode %.1fus decode %.1fus\n",
+	 n, (double)len / n, (n + 255) / 256, (t1-t0) / reps, (t2-t1) / reps);
+  printf("  sparse     %5d, %4.1f:1, %2d flash pages, encode %.1fus\n",
+	 sparse, (double)len / sparse, (sparse + 255) / 256, (t3-t2) / reps);
+
+  for(int f=0; f<sizeof(flags)/sizeof(flags[0]); f++)
+    {
+      ram_image_convert(expect, image, len, flags[f]);
+      memset(got, 0x5A, len);
+
+      if( (snap_decode(got, len, packed, n, flags[f]) != len) || (memcmp(got, expect, len) != 0) )
+	{
+	  fprintf(stderr, "%s: decode with flags %d doesn't match\n", path, flags[f]);
+	  return(0);
+	}
+
+      memset(got, 0x5A, len);
+
+      if( (snap_sparse_decode(got, len, sparse_buf, sparse, flags[f]) != len) || (memcmp(got, expect, len) != 0) )
+	{
+	  fprintf(stderr, "%s: sparse decode with flags %d doesn't match\n", path, flags[f]);
+	  return(0);
+	}
+    }
+
+  return(1);
+}
+
+int crc(char *path)
+{
+  static uint8_t slot[MAX_IMAGE];
+  int len = read_file(path, image, sizeof(image));
+
+  if( (len < 0) || !image_ok(len) )
+    {
+      return(0);
+    }
+
+  // Same order, bus polarity
+  ram_image_convert(slot, image, len, IMAGE_INVERT);
+  printf("%s: CRC32 %08X, slot format %08X\n", path, crc32_of(image, len), crc32_of(slot, len));
+  return(1);
+}
+
+int main(int argc, char *argv[])
+{
+  int len;
+  int fd;
+
+  if( (argc >= 3) && (strcmp(argv[1], "stats") == 0) )
+    {
+      int ok = 1;
+
+      for(int i=2; i<argc; i++)
+	{
+	  ok &= stats(argv[i]);
+	}
+      return(!ok);
+    }
+
+  if( (argc >= 3) && (strcmp(argv[1], "crc") == 0) )
+    {
+      int ok = 1;
+
+      for(int i=2; i<argc; i++)
+	{
+	  ok &= crc(argv[i]);
+	}
+      return(!ok);
+    }
+
+  if( argc != 4 )
+    {
+      fprintf(stderr, "Usage: snap_tool pack|unpack|get|put <from/device> <to/image>\n"
+	      "       snap_tool stats|crc <image> ...\n");
+      return(2);
+    }
+
+  if( strcmp(argv[1], "pack") == 0 )
+    {
+      if( ((len = read_file(argv[2], image, sizeof(image))) < 0) || !image_ok(len) )
+	{
+	  return(1);
+	}
+      return(!write_file(argv[3], packed, pack(len)));
+    }
+
+  if( strcmp(argv[1], "unpack") == 0 )
+    {
+      if( ((len = read_file(argv[2], capture, sizeof(capture))) < 0) || ((len = unpack(capture, len, argv[2])) < 0) )
+	{
+	  return(1);
+	}
+      return(!write_file(argv[3], image, len));
+    }
+
+  if( strcmp(argv[1], "get") == 0 )
+    {
+      if( (fd = open_device(argv[2])) < 0 )
+	{
+	  return(1);
+	}
+
+      if( write(fd, "x", 1) != 1 )
+	{
+	  perror(argv[2]);
+	  return(1);
+	}
+      len = read_quiet(fd, capture, sizeof(capture));
+      close(fd);
+
+      if( (len = unpack(capture, len, argv[2])) < 0 )
+	{
+	  return(1);
+	}
+      return(!write_file(argv[3], image, len));
+    }
+
+  if( strcmp(argv[1], "put") == 0 )
+    {
+      int n;
+
+      if( ((len = read_file(argv[3], image, sizeof(image))) < 0) || !image_ok(len) )
+	{
+	  return(1);
+	}
+
+      if( (fd = open_device(argv[2])) < 0 )
+	{
+	  return(1);
+	}
+
+      n = pack(len);
+      if( (write(fd, "X", 1) != 1) || (write(fd, packed, n) != n) )
+	{
+	  perror(argv[2]);
+	  return(1);
+	}
+
+      // The firmware says how it went
+      len = read_quiet(fd, capture, sizeof(capture)-1);
+      capture[len] = '\0';
+      close(fd);
+
+      printf("%s", (char *)capture);
+      return(strstr((char *)capture, "Loaded") == NULL);
+    }
+
+  fprintf(stderr, "Unknown command %s\n", argv[1]);
+  return(2);
+}
@@ -0,0 +1,538 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Bus trace capture
+//
+// Records the trace the RAM replacement firmware streams on its vendor
+// interface ('U' command) to a file, and prints a capture. Linux only, it
+// talks to the device through usbfs so there's nothing to install, but
+// the user needs write access to /dev/bus/usb (a udev rule for
+// 2e8a:000a, or run as root).
+//
+// Usage: trace_capture record <capture> [seconds]
+//        trace_capture print <capture>
+//        trace_capture stats <capture>
+//
+// record runs until interrupted, or for the given time, printing the
+// rate and any drops each second. It stops on its own when the firmware
+// stops streaming.
+//
+// stats counts the records and payload bytes of each frame format. For
+// raw frames it also codes them as the firmware would and checks they
+// decode back, to show what coded streaming would save.
+//
+// A capture is the frames of common/trace_stream.h with the padding
+// taken out: each TRACE_FRAME header followed by its bytes of payload.
+// Coded frames before the first key frame can't be decoded and are
+// skipped.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#include "trace_ring.h"
+#include "trace_stream.h"
+#include "trace_codec.h"
+
+#define BUS_NUM_CE         4
+#define BUS_ADDR_BITS      10
+#define BUS_A0_PIN         0
+#define BUS_D0_PIN         10
+#define BUS_CE0_PIN        14
+#define BUS_W_PIN          19
+#define BUS_ADDR_INVERTED  1
+
+#include "upd444_bus.h"
+
+#define SYSFS_USB  "/sys/bus/usb/devices"
+
+// Give up when the firmware has sent nothing for this long
+#define IDLE_TIMEOUT_S  5
+
+// Most records a frame can hold, all runs of predicted reads
+#define FRAME_RECORDS_MAX  (TRACE_FRAME_PAYLOAD * TRACE_RUN_MAX)
+
+volatile int stop = 0;
+
+void on_signal(int sig)
+{
+  stop = 1;
+}
+
+long sysfs_value(char *dev, char *name, int base)
+{
+  char path[512];
+  char line[64];
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "%s/%s/%s", SYSFS_USB, dev, name);
+  if( (fp = fopen(path, "r")) == NULL )
+    {
+      return(-1);
+    }
+
+  if( fgets(line, sizeof(line), fp) == NULL )
+    {
+      line[0] = '\0';
+    }
+  fclose(fp);
+
+  return(strtol(line, NULL, base));
+}
+
+// Open the first FX702P RAM on the bus and claim the trace interface
+int open_trace(void)
+{
+  DIR *dir = opendir(SYSFS_USB);
+  struct dirent *e;
+  char path[64];
+  unsigned int itf = TRACE_USB_INTERFACE;
+  int fd = -1;
+
+  if( dir == NULL )
+    {
+      perror(SYSFS_USB);
+      return(-1);
+    }
+
+  while( (fd < 0) && ((e = readdir(dir)) != NULL) )
+    {
+      // Devices, not interfaces
+      if( (e->d_name[0] == '.') || (strchr(e->d_name, ':') != NULL) )
+	{
+	  continue;
+	}
+
+      if( (sysfs_value(e->d_name, "idVendor", 16) != TRACE_USB_VID) || (sysfs_value(e->d_name, "idProduct", 16) != TRACE_USB_PID) )
+	{
+	  continue;
+	}
+
+      snprintf(path, sizeof(path), "/dev/bus/usb/%03ld/%03ld", sysfs_value(e->d_name, "busnum", 10), sysfs_value(e->d_name, "devnum", 10));
+      if( (fd = open(path, O_RDWR)) < 0 )
+	{
+	  perror(path);
+	  break;
+	}
+
+      if( ioctl(fd, USBDEVFS_CLAIMINTERFACE, &itf) < 0 )
+	{
+	  fprintf(stderr, "%s: can't claim interface %d: %s\n", path, itf, strerror(errno));
+	  close(fd);
+	  fd = -1;
+	  break;
+	}
+    }
+  closedir(dir);
+
+  if( (fd < 0) && (e == NULL) )
+    {
+      fprintf(stderr, "No %04x:%04x device found\n", TRACE_USB_VID, TRACE_USB_PID);
+    }
+
+  return(fd);
+}
+
+int frame_ok(TRACE_FRAME *f)
+{
+  if( (f->magic != TRACE_FRAME_MAGIC) || (f->version != TRACE_FRAME_VERSION) || (f->bytes > TRACE_FRAME_PAYLOAD) )
+    {
+      return(0);
+    }
+
+  switch( f->format )
+    {
+    case TRACE_FORMAT_RAW:
+      return( f->bytes == f->count * sizeof(uint32_t) );
+
+    case TRACE_FORMAT_CODED:
+    case TRACE_FORMAT_KEY:
+      return( f->count <= FRAME_RECORDS_MAX );
+    }
+
+  return(0);
+}
+
+// Read the next frame of a capture, returns 0 at the end or -1 if it's bad
+int read_frame(FILE *fp, TRACE_FRAME *f, uint8_t *payload)
+{
+  if( fread(f, sizeof(*f), 1, fp) != 1 )
+    {
+      return(0);
+    }
+
+  if( !frame_ok(f) || (fread(payload, 1, f->bytes, fp) != f->bytes) )
+    {
+      return(-1);
+    }
+
+  return(1);
+}
+
+// The records of a frame. Returns how many, -1 if they don't decode or
+// -2 for a coded frame before any key frame.
+int frame_records(TRACE_CODEC *c, int *have_key, TRACE_FRAME *f, uint8_t *payload, uint32_t *rec)
+{
+  if( f->format == TRACE_FORMAT_RAW )
+    {
+      memcpy(rec, payload, f->bytes);
+      return(f->count);
+    }
+
+  if( f->format == TRACE_FORMAT_KEY )
+    {
+      *have_key = 1;
+    }
+
+  if( !*have_key )
+    {
+      return(-2);
+    }
+
+  trace_codec_start(c, f->format == TRACE_FORMAT_KEY);
+  if( trace_decode(c, rec, f->count, payload, f->bytes) != f->count )
+    {
+      return(-1);
+    }
+
+  return(f->count);
+}
+
+int record(char *path, int seconds)
+{
+  static uint8_t buf[TRACE_FRAME_BYTES];
+  TRACE_FRAME *f = (TRACE_FRAME *)buf;
+  FILE *fp;
+  int fd;
+  time_t start = time(NULL);
+  time_t last_data = start;
+  time_t last_report = start;
+  uint64_t records = 0;
+  uint64_t gaps = 0;
+  uint64_t bad = 0;
+  uint32_t expect = 0;
+  uint32_t first_lost = 0;
+  uint32_t lost = 0;
+  uint32_t stalls = 0;
+  int have_frame = 0;
+  uint64_t report_records = 0;
+
+  if( (fd = open_trace()) < 0 )
+    {
+      return(0);
+    }
+
+  if( (fp = fopen(path, "wb")) == NULL )
+    {
+      perror(path);
+      close(fd);
+      return(0);
+    }
+
+  signal(SIGINT, on_signal);
+  printf("Recording to %s, ^C to stop\n", path);
+
+  while( !stop )
+    {
+      struct usbdevfs_bulktransfer bt;
+      time_t now;
+      int n;
+
+      bt.ep = TRACE_USB_EP;
+      bt.len = sizeof(buf);
+      bt.timeout = 500;
+      bt.data = buf;
+
+      n = ioctl(fd, USBDEVFS_BULK, &bt);
+      now = time(NULL);
+
+      if( (n < 0) && (errno != ETIMEDOUT) && (errno != EINTR) )
+	{
+	  perror("USB");
+	  break;
+	}
+
+      if( n == sizeof(buf) )
+	{
+	  if( !frame_ok(f) )
+	    {
+	      bad++;
+	      continue;
+	    }
+
+	  if( !have_frame )
+	    {
+	      first_lost = f->lost;
+	      have_frame = 1;
+	    }
+	  else
+	    {
+	      gaps += f->seq - expect;
+	    }
+	  expect = f->seq + f->count;
+	  lost = f->lost;
+	  stalls = f->stalls;
+
+	  records += f->count;
+	  last_data = now;
+
+	  if( fwrite(buf, sizeof(TRACE_FRAME) + f->bytes, 1, fp) != 1 )
+	    {
+	      perror(path);
+	      break;
+	    }
+	}
+
+      if( now != last_report )
+	{
+	  printf("%8ld s  %10llu records  %8llu/s  %llu lost  %u stalls\n",
+		 (long)(now - start),
+		 (unsigned long long)records,
+		 (unsigned long long)(records - report_records) / (now - last_report),
+		 (unsigned long long)gaps,
+		 stalls);
+	  report_records = records;
+	  last_report = now;
+	}
+
+      if( (seconds > 0) && (now - start >= seconds) )
+	{
+	  break;
+	}
+
+      if( have_frame && (now - last_data >= IDLE_TIMEOUT_S) )
+	{
+	  printf("Stream stopped\n");
+	  break;
+	}
+    }
+
+  fclose(fp);
+  close(fd);
+
+  printf("%llu records, %llu lost", (unsigned long long)records, (unsigned long long)gaps);
+  if( gaps != (uint32_t)(lost - first_lost) )
+    {
+      // The device counts what it dropped too, they should agree
+      printf(" (device says %u)", lost - first_lost);
+    }
+  printf(", %llu bad frames\n", (unsigned long long)bad);
+
+  return(bad == 0);
+}
+
+int print(char *path)
+{
+  static uint8_t payload[TRACE_FRAME_PAYLOAD];
+  static uint32_t rec[FRAME_RECORDS_MAX];
+  static TRACE_CODEC codec;
+  TRACE_FRAME f;
+  FILE *fp = fopen(path, "rb");
+  uint32_t expect = 0;
+  int first = 1;
+  int have_key = 0;
+  int r;
+
+  if( fp == NULL )
+    {
+      perror(path);
+      return(0);
+    }
+
+  while( (r = read_frame(fp, &f, payload)) > 0 )
+    {
+      int n = frame_records(&codec, &have_key, &f, payload, rec);
+
+      if( n == -1 )
+	{
+	  r = -1;
+	  break;
+	}
+
+      if( n == -2 )
+	{
+	  printf("-- %u records before the first key frame\n", f.count);
+	  continue;
+	}
+
+      if( !first && (f.seq != expect) )
+	{
+	  printf("-- %u lost\n", f.seq - expect);
+	}
+      first = 0;
+      expect = f.seq + f.count;
+
+      // As the firmware's 't' command
+      for(int i=0; i<n; i++)
+	{
+	  printf("%08u: %04X %01X %02X %c\n", f.seq + i,
+		 BUS_CANONICAL_ADDR(TRACE_ADDR(rec[i])),
+		 TRACE_CHIP(rec[i]),
+		 TRACE_DATA(rec[i]),
+		 TRACE_IS_WRITE(rec[i]) ? 'W' : 'R');
+	}
+    }
+
+  fclose(fp);
+
+  if( r != 0 )
+    {
+      fprintf(stderr, "%s: bad frame\n", path);
+      return(0);
+    }
+
+  return(1);
+}
+
+// Code a raw frame's records as the firmware would, returns the bytes or
+// -1 if they don't decode back the same
+int recode(uint32_t *rec, int n)
+{
+  static TRACE_CODEC enc;
+  static TRACE_CODEC dec;
+  static uint8_t coded[TRACE_FRAME_PAYLOAD];
+  static uint32_t check[FRAME_RECORDS_MAX];
+  int bytes = 0;
+
+  // A raw frame's worth always codes into a frame
+  trace_codec_start(&enc, 1);
+  for(int i=0; i<n; i++)
+    {
+      bytes += trace_encode(&enc, coded + bytes, rec[i]);
+    }
+  bytes += trace_encode_flush(&enc, coded + bytes);
+
+  trace_codec_start(&dec, 1);
+  if( (trace_decode(&dec, check, FRAME_RECORDS_MAX, coded, bytes) != n) || (memcmp(check, rec, n * sizeof(uint32_t)) != 0) )
+    {
+      return(-1);
+    }
+
+  return(bytes);
+}
+
+int stats(char *path)
+{
+  static uint8_t payload[TRACE_FRAME_PAYLOAD];
+  static uint32_t rec[FRAME_RECORDS_MAX];
+  static TRACE_CODEC codec;
+  static const char *name[] = { "raw", "coded", "key" };
+  uint64_t frames[3] = { 0 };
+  uint64_t records[3] = { 0 };
+  uint64_t bytes[3] = { 0 };
+  uint64_t recoded = 0;
+  uint64_t skipped = 0;
+  TRACE_FRAME f;
+  FILE *fp = fopen(path, "rb");
+  int have_key = 0;
+  int r;
+
+  if( fp == NULL )
+    {
+      perror(path);
+      return(0);
+    }
+
+  while( (r = read_frame(fp, &f, payload)) > 0 )
+    {
+      int n = frame_records(&codec, &have_key, &f, payload, rec);
+
+      if( n == -1 )
+	{
+	  r = -1;
+	  break;
+	}
+
+      if( n == -2 )
+	{
+	  skipped += f.count;
+	  continue;
+	}
+
+      if( f.format == TRACE_FORMAT_RAW )
+	{
+	  int b = recode(rec, n);
+
+	  if( b < 0 )
+	    {
+	      fprintf(stderr, "%s: frame at %u doesn't code back\n", path, f.seq);
+	      fclose(fp);
+	      return(0);
+	    }
+	  recoded += b;
+	}
+
+      frames[f.format]++;
+      records[f.format] += n;
+      bytes[f.format] += f.bytes;
+    }
+
+  fclose(fp);
+
+  if( r != 0 )
+    {
+      fprintf(stderr, "%s: bad frame\n", path);
+      return(0);
+    }
+
+  for(int i=0; i<3; i++)
+    {
+      if( frames[i] == 0 )
+	{
+	  continue;
+	}
+
+      printf("%-5s %8llu frames %10llu records %10llu bytes  %.2f bytes/record",
+	     name[i],
+	     (unsigned long long)frames[i],
+	     (unsigned long long)records[i],
+	     (unsigned long long)bytes[i],
+	     records[i] ? (double)bytes[i] / records[i] : 0.0);
+
+      if( i == TRACE_FORMAT_RAW )
+	{
+	  printf(", coded %llu bytes (%.2fx)", (unsigned long long)recoded, recoded ? (double)bytes[i] / recoded : 0.0);
+	}
+      printf("\n");
+    }
+
+  if( skipped )
+    {
+      printf("%llu records before the first key frame\n", (unsigned long long)skipped);
+    }
+
+  return(1);
+}
+
+int main(int argc, char *argv[])
+{
+  if( (argc >= 3) && (argc <= 4) && (strcmp(argv[1], "record") == 0) )
+    {
+      return(!record(argv[2], (argc == 4) ? atoi(argv[3]) : 0));
+    }
+
+  if( (argc == 3) && (strcmp(argv[1], "print") == 0) )
+    {
+      return(!print(argv[2]));
+    }
+
+  if( (argc == 3) && (strcmp(argv[1], "stats") == 0) )
+    {
+      return(!stats(argv[2]));
+    }
+
+  fprintf(stderr, "Usage: trace_capture record <capture> [seconds]\n"
+	  "       trace_capture print <capture>\n"
+	  "       trace_capture stats <capture>\n");
+  return(2);
+}